@@ -5,7 +5,10 @@
 #include "queue.h"
 #include "navigation.h"
 #include "detect_inner.h"
+#include "project.h"
 #include "pipeline.h"
+#include "serport.h"
+#include "mask.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <math.h>
@@ -22,14 +25,17 @@ void *volatile browse_buffer;
 static DetectOutput lastSteering;
 static char const *detectDump;
 
-FrameQueue analyzer_input_queue(2, PROC_WIDTH * PROC_HEIGHT * 6 / 4, PROC_WIDTH, PROC_HEIGHT, 2);
+//  made by start_analyzer(): one frame for each worker, and one to capture into
+static FrameQueue *volatile analyzer_input_queue;
 FrameQueue analyzer_analyzed_queue(1, PROC_WIDTH * PROC_HEIGHT, PROC_WIDTH, PROC_HEIGHT, 1);
 FrameQueue flat_map_queue(1, PROJECT_WIDTH * PROJECT_HEIGHT, PROJECT_WIDTH, PROJECT_HEIGHT, 1);
+FrameQueue flat_color_queue(1, PROJECT_WIDTH * PROJECT_HEIGHT * 3, PROJECT_WIDTH, PROJECT_HEIGHT, FRAME_FORMAT_RGB);
 
 
 int num_analyzed;
 uint64_t analyze_start;
 bool complainedNoSteering = false;
+static uint64_t frameStart[FRAME_QUEUE_MAX];    //  by input Frame::index_
 
 static unsigned char analyze_overflow[PROC_WIDTH * PROC_HEIGHT];
 
@@ -42,13 +48,26 @@ void detect_write_params(char const *dumpName) {
     detectDump = dumpName;
 }
 
-void analyze_data(Frame *iframe, Frame *dframe) {
+//  Steering keeps state from frame to frame, so this runs one frame at a 
+//  time, in capture order, however many analyzer workers there are. With 
+//  a mask, the frame was already classified (by the staged analyzer.)
+void analyze_data(Frame *iframe, unsigned char const *mask, Frame *dframe) {
     unsigned char *dcls = dframe ? dframe->data_ : analyze_overflow;
-    //  turn UYV into "is yellow"
-    detect_color_inner(iframe->data_, dcls, PROC_WIDTH, PROC_HEIGHT);
+    char const *dd = detectDump;
+    if (mask && (dframe || dd)) {
+        mask_to_bytes(mask, dcls, PROC_WIDTH, PROC_HEIGHT);
+    } else if (!dframe && dd) {
+        detect_color_inner(iframe->data_, dcls, PROC_WIDTH, PROC_HEIGHT);
+    }
     DetectOutput output = { 0 };
+    if (has_tstate()) {
+        T2H_State const &st = tstate();
+        detect_set_odometry(st.m1, st.m2);
+    }
     Frame *flatFrame = flat_map_queue.beginWrite();
-    if (determine_steering(dcls, PROC_WIDTH, PROC_HEIGHT, flatFrame, &output)) {
+    //  turn UYV into "is yellow," on the ground
+    if (determine_steering_format(mask ? mask : iframe->data_, mask ? FRAME_FORMAT_MASK : FRAME_FORMAT_YUV420,
+            PROC_WIDTH, PROC_HEIGHT, flatFrame, &output)) {
         if (!complainedNoSteering) {
             fprintf(stderr, "Could not determine steering\n");
             complainedNoSteering = true;
@@ -61,11 +80,19 @@ void analyze_data(Frame *iframe, Frame *dframe) {
     }
     if (flatFrame) {
         iframe->link(flatFrame);
+        //  the colour ground view rides behind the flat map, for the GUI
+        Frame *colorFrame = flat_color_queue.beginWrite();
+        if (colorFrame) {
+            if (detect_project_color(iframe->data_, PROC_WIDTH, PROC_HEIGHT, colorFrame->data_, PROJECT_PACKED_RGB)) {
+                colorFrame->recycle();
+            } else {
+                iframe->link(colorFrame);
+            }
+        }
     }
     lastSteering = output;
     navigation_set_image(output.drive, output.steer);
 
-    char const *dd = detectDump;
     if (dd) {
         detectDump = NULL;
         FILE *f = fopen(dd, "wb");
@@ -101,49 +128,141 @@ void analyze_data(Frame *iframe, Frame *dframe) {
     }
 }
 
+//  This part runs on any of the analyzer workers at once. Steering only 
+//  classifies the pixels it projects; the GUI overlay wants the whole frame.
 void analyze_buffer(Pipeline *, Frame *&inFrame, Frame *&outFrame, void *) {
-    uint64_t usstart = vcos_getmicrosecs64();
+    frameStart[inFrame->index_] = vcos_getmicrosecs64();
     void *bbd = browse_buffer;
     if (bbd) {
         memcpy(inFrame->data_, bbd, inFrame->size_);
     }
-    analyze_data(inFrame, outFrame);
     if (outFrame) {
+        detect_color_inner(inFrame->data_, outFrame->data_, PROC_WIDTH, PROC_HEIGHT);
         outFrame->link(inFrame);
         inFrame = NULL;
     }
+}
+
+//  The analyzer is built by start_analyzer(): one stage that does it all 
+//  (on analyzer_workers threads,) or with analyzer_staged=1, classifying 
+//  into a mask on one core while the frame before is steered on another.
+static PipelineChain *analyzer_chain;
+static int analyzer_workers = 1;
+static bool analyzer_staged = false;
+#define ANALYZER_MASK_DEPTH 2
+#define ANALYZER_CLASSIFY_CPU 1
+#define ANALYZER_STEER_CPU 2
+
+static void analyze_stats(Frame *iframe) {
+    uint64_t usstart = frameStart[iframe->index_];
     uint64_t usstop = vcos_getmicrosecs64();
     usspent += usstop - usstart;
     ++framesAnalyzed;
     if ((framesAnalyzed >= 500) || (usspent >= 10000000)) {
         fprintf(stderr, "analysis avg: %.3f ms\n", usspent * 0.001 / framesAnalyzed);
-        int stin, stout, stfl;
-        analyzer_input_queue.getStats(stin, stout, stfl);
-        fprintf(stderr, "input_queue: %d in, %d out, %d inflight\n", stin, stout, stfl);
+        int stin, stout, stfl, stover;
+        analyzer_input_queue->getStats(stin, stout, stfl, stover);
+        fprintf(stderr, "input_queue: %d in, %d out, %d inflight, %d overwritten\n", stin, stout, stfl, stover);
+        //  the queues between stages
+        for (int i = 0; i < analyzer_chain->stages() - 1; ++i) {
+            analyzer_chain->stageOutput(i)->getStats(stin, stout, stfl, stover);
+            fprintf(stderr, "%s_queue: %d in, %d out, %d inflight, %d overwritten\n",
+                    analyzer_chain->stageName(i), stin, stout, stfl, stover);
+        }
         analyzer_analyzed_queue.getStats(stin, stout, stfl);
         fprintf(stderr, "analyzed_queue: %d in, %d out, %d inflight\n", stin, stout, stfl);
         flat_map_queue.getStats(stin, stout, stfl);
         fprintf(stderr, "flat_queue: %d in, %d out, %d inflight\n", stin, stout, stfl);
+        flat_color_queue.getStats(stin, stout, stfl);
+        fprintf(stderr, "flat_color_queue: %d in, %d out, %d inflight\n", stin, stout, stfl);
         framesAnalyzed = 0;
         usspent = 0;
     }
 }
 
-Pipeline analyzer_input_pipeline(analyze_buffer);
+void analyze_ordered(Pipeline *, Frame *inFrame, Frame *outFrame, void *) {
+    analyze_data(inFrame, NULL, outFrame);
+    analyze_stats(inFrame);
+}
+
+//  First stage of the staged analyzer. The camera frame rides behind its 
+//  mask to the steering stage.
+void classify_buffer(Pipeline *, Frame *&inFrame, Frame *&outFrame, void *) {
+    frameStart[inFrame->index_] = vcos_getmicrosecs64();
+    void *bbd = browse_buffer;
+    if (bbd) {
+        memcpy(inFrame->data_, bbd, inFrame->size_);
+    }
+    if (outFrame) {
+        detect_color_mask(inFrame->data_, outFrame->data_, PROC_WIDTH, PROC_HEIGHT);
+        outFrame->link(inFrame);
+        inFrame = NULL;
+    }
+}
+
+//  Second stage: steer from the mask. The GUI wants the camera frame right 
+//  behind the analyzed one, so the mask lets go of it here.
+void steer_mask(Pipeline *, Frame *&inFrame, Frame *&outFrame, void *) {
+    Frame *camera = inFrame->link_;
+    inFrame->link_ = NULL;
+    analyze_data(camera, inFrame->data_, outFrame);
+    analyze_stats(camera);
+    if (outFrame) {
+        outFrame->link(camera);
+    } else {
+        camera->recycle();
+    }
+}
 
 void start_analyzer() {
     read_analyzer_settings();
+    //  frames may still be out with the GUI, so the queues stay around, and 
+    //  the shape of the chain is fixed the first time through
+    if (!analyzer_chain) {
+        int workers = (int)get_setting_int("analyzer_workers", 1);
+        analyzer_workers = workers < 1 ? 1 : workers > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : workers;
+        analyzer_staged = get_setting_int("analyzer_staged", 0) != 0;
+        if (analyzer_staged) {
+            analyzer_workers = 1;
+        }
+    }
+    if (!analyzer_input_queue) {
+        //  A camera frame is held by each worker, plus one to capture into. 
+        //  Staged, it is held while classified, behind each mask waiting 
+        //  for steering, and while steered and shown, plus one to capture 
+        //  into; with fewer, the camera waits and the stages take turns.
+        int frames = analyzer_staged ? ANALYZER_MASK_DEPTH + 3 : analyzer_workers + 1;
+        analyzer_input_queue = new FrameQueue(frames, PROC_WIDTH * PROC_HEIGHT * 6 / 4, PROC_WIDTH, PROC_HEIGHT, 2);
+    }
+    if (!analyzer_chain) {
+        analyzer_chain = new PipelineChain();
+        analyzer_chain->input(analyzer_input_queue);
+        if (analyzer_staged) {
+            analyzer_chain->stage("classify", classify_buffer, ANALYZER_MASK_DEPTH,
+                        MASK_SIZE(PROC_WIDTH, PROC_HEIGHT), PROC_WIDTH, PROC_HEIGHT, FRAME_FORMAT_MASK)
+                    .policy(FRAME_POLICY_LATEST).cpu(ANALYZER_CLASSIFY_CPU)
+                .stage("steer", steer_mask, &analyzer_analyzed_queue).cpu(ANALYZER_STEER_CPU);
+        } else {
+            analyzer_chain->stage("analyze", analyze_buffer, &analyzer_analyzed_queue)
+                    .ordered(analyze_ordered).workers(analyzer_workers);
+        }
+    }
+    //  steering wants the newest picture, not the oldest one waiting
+    bool latest = get_setting_int("analyzer_latest_frame", 1) != 0;
+    analyzer_input_queue->setPolicy(latest ? FRAME_POLICY_LATEST : FRAME_POLICY_DROP_NEW);
+    fprintf(stderr, "analyzer_settings: analyzer_latest_frame=%d analyzer_workers=%d analyzer_staged=%d\n",
+            latest, analyzer_workers, analyzer_staged);
     fprintf(stderr, "Starting analyzer; %.2f %.2f %.2f / %.2f %.2f %.2f\n",
             detect_ycenter, detect_ucenter, detect_vcenter,
             detect_ygain, detect_cgain, detect_d2);
-    analyzer_input_pipeline.connectInput(&analyzer_input_queue);
-    analyzer_input_pipeline.connectOutput(&analyzer_analyzed_queue);
-    analyzer_input_pipeline.start(NULL);
+    analyzer_chain->start(NULL);
 }
 
 void stop_analyzer() {
     fprintf(stderr, "Stopping analyzer\n");
-    analyzer_input_pipeline.stop();
+    if (analyzer_chain) {
+        analyzer_chain->stop();
+    }
     fprintf(stderr, "Analyzer stopped\n");
 }
 
@@ -161,7 +280,11 @@ int analyzer_consume(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
     if (!analyze_start) {
         analyze_start = usstart;
     }
-    Frame *in = analyzer_input_queue.beginWrite();
+    FrameQueue *queue = analyzer_input_queue;
+    if (!queue) {
+        return 0;
+    }
+    Frame *in = queue->beginWrite();
     static int nTotal;
     static int nMissed = 0;
     ++nTotal;
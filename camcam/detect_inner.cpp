@@ -2,10 +2,15 @@
 #include "settings.h"
 #include "project.h"
 #include "queue.h"
+#include "mask.h"
+#include "plock.h"
+#include <pthread.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <time.h>
 #include <algorithm>
 #include "../stb/stb_image_write.h"
 
@@ -28,32 +33,132 @@ static bool complainedNoClusters = false;
 static int dwidth = 0;
 static int dheight = 0;
 static ProjectData *dproject;
+static ProjectSamples *dsamples;
+static unsigned char *dsample_class;
+static ProjectFootprint *dfootprint;
+static unsigned char *dframe_mask;
 
-#define PROJECT_RESOLUTION 0.67f
-#define CAMERA_HEIGHT 25.0f
-#define CAMERA_WIDTH_RADIANS (60.0f * 3.1415927f / 180.0f)
-#define ANGLED_DOWN_RADIANS (25.0f * 3.1415927f / 180.0f)
+//  0 for nearest-sample projection, else the occupancy that makes a cell set
+static int project_occupancy_threshold = 0;
+
+//  0 for evenly spaced flat map rows, else the geometric growth per row
+static float project_row_growth = 0.0f;
+
+//  re-estimate camera pitch every frame, and re-aim the plan to match
+static bool project_pitch_tracking = false;
+static ProjectParameters dparams;
+static float dpitch = ANGLED_DOWN_RADIANS;          //  what the plan is aimed at
+static float dpitch_filtered = ANGLED_DOWN_RADIANS;
+
+#define PITCH_RANGE (4.0f * 3.1415927f / 180.0f)    //  around ANGLED_DOWN_RADIANS
+#define PITCH_SMOOTHING 0.2f
+#define PITCH_REPLAN (0.03f * 3.1415927f / 180.0f)
+#define PITCH_MAX_SEGMENTS 32
+#define PITCH_MIN_LENGTH 10.0f                      //  cells
+
+//  lens distortion, from mkcalib
+static float project_k1 = 0.0f;
+static float project_k2 = 0.0f;
+static float project_p1 = 0.0f;
+static float project_p2 = 0.0f;
+
+//  where baked projection plans are kept between runs
+#define PLAN_CACHE_DIR "/var/tmp"
 
 #define INTERCEPT_GAIN 1.0f
 #define SLOPE_GAIN 0.2f
 
+//  clean up the flat map mask before labeling: detect_morphology in 
+//  camcam.ini is none, open (drop specks), close (fill pinholes), or 
+//  open_close
+#define MORPH_NONE 0
+#define MORPH_OPEN 1
+#define MORPH_CLOSE 2
+#define MORPH_OPEN_CLOSE 3
+static int detect_morphology = MORPH_NONE;
+static char const *morphology_names[] = { "none", "open", "close", "open_close" };
+
+//  keep a ground map around the rover from frame to frame (ground_map in 
+//  camcam.ini), moved along by wheel odometry
+static bool ground_map_enabled = false;
+static float odometry_per_tick = 0.0f;      //  ground units per encoder count
+static float odometry_track = 0.0f;         //  between the wheels; 0 to not turn
+
+//  what steering looks for in the flat map: steer_detector in camcam.ini 
+//  is clusters, or hough (straight lines, which also see dashed ones)
+#define DETECTOR_CLUSTERS 0
+#define DETECTOR_HOUGH 1
+static int steer_detector = DETECTOR_CLUSTERS;
+static char const *detector_names[] = { "clusters", "hough" };
+
+//  steer_mode in camcam.ini: line (turn on the intercept and slope of a 
+//  line through the clusters) or pursuit (pure pursuit along a curved 
+//  path, see steer_pursuit())
+#define STEER_LINE 0
+#define STEER_PURSUIT 1
+static int steer_mode = STEER_LINE;
+static char const *steer_mode_names[] = { "line", "pursuit" };
+static float pursuit_gain = 5.0f;               //  steer per radian of wheel angle
+static float pursuit_lookahead = 40.0f;         //  ground units (camera height is 25)
+static float pursuit_lookahead_speed = 15.0f;   //  more per unit of drive
+static float pursuit_wheelbase = 12.0f;         //  ground units, axle to axle
+static float pursuit_max_angle = 0.6f;          //  radians of front wheel lock
+
+//  fit the steering line robustly (RANSAC over runs) instead of by least 
+//  squares over all clusters
+static bool detect_robust_fit = false;
+
+//  steer only by clusters that have been tracked for a few frames
+static bool detect_track_steering = false;
+
+#define MAX_TRACKS 64
+#define TRACK_GATE 8.0f         //  ground units past the cluster's own extent
+#define TRACK_ALPHA 0.5f        //  alpha-beta filter gains
+#define TRACK_BETA 0.2f
+#define TRACK_CONFIRM 2         //  frames matched before a track steers
+#define TRACK_COAST 3           //  frames a track outlives its cluster
+
 
 #define MIN_CLUSTER_SIZE 8
-#define MAX_CLUSTERS 255
+#define MAX_CLUSTERS 2048
 Cluster g_clusters[MAX_CLUSTERS];
 
 unsigned char flat_map[PROJECT_WIDTH * PROJECT_HEIGHT];
 unsigned char flat_work[PROJECT_WIDTH * PROJECT_HEIGHT];
 
+//  every run of set cells in the flat map, with its cluster label; at most 
+//  one run per two cells of a row
+#define MAX_RUNS ((PROJECT_WIDTH + 1) / 2 * PROJECT_HEIGHT)
+ClusterRun g_runs[MAX_RUNS];
+int g_num_runs;
+unsigned char flat_mask[MASK_SIZE(PROJECT_WIDTH, PROJECT_HEIGHT)];
+static unsigned char flat_morph_tmp[MASK_SIZE(PROJECT_WIDTH, PROJECT_HEIGHT)];
+
+static void filter_flat_mask() {
+    if (detect_morphology & MORPH_OPEN) {
+        mask_open(flat_mask, flat_mask, flat_morph_tmp, PROJECT_WIDTH, PROJECT_HEIGHT);
+    }
+    if (detect_morphology & MORPH_CLOSE) {
+        mask_close(flat_mask, flat_mask, flat_morph_tmp, PROJECT_WIDTH, PROJECT_HEIGHT);
+    }
+}
+
 unsigned char *get_sqproj(int *ow, int *oh) {
     *ow = PROJECT_WIDTH;
     *oh = PROJECT_HEIGHT;
     return flat_map;
 }
 
+//  the cluster labels, painted from the runs and truncated to bytes for 
+//  looking at
 unsigned char *get_sqproj_work(int *ow, int *oh) {
     *ow = PROJECT_WIDTH;
     *oh = PROJECT_HEIGHT;
+    memset(flat_work, 0, sizeof(flat_work));
+    for (int i = 0; i != g_num_runs; ++i) {
+        ClusterRun const &run = g_runs[i];
+        memset(flat_work + run.row * PROJECT_WIDTH + run.x0, (unsigned char)run.label, run.x1 - run.x0 + 1);
+    }
     return flat_work;
 }
 
@@ -86,153 +191,1489 @@ int paint_clusters(unsigned char *buf, int w, int h, Cluster const *cl, int ncl)
                 }
             }
         }
-        ++cl;
+        ++cl;
+    }
+    return 0;
+}
+
+//  Pixel sources for detect_clusters(). runs() calls emit(x0, x1) for each 
+//  horizontal run of set pixels in row r, left to right; weight() is the 
+//  weight of pixels x0..x1 of row r, in units of weight_scale().
+struct ByteSource {
+    unsigned char const *data;
+    int width;
+    unsigned char label;
+    template<typename Fn>
+    void runs(int r, Fn const &emit) const {
+        unsigned char const *row = data + r * width;
+        for (int c = 0; c < width; ++c) {
+            if (row[c] == label) {
+                int x0 = c;
+                while (c + 1 < width && row[c + 1] == label) {
+                    ++c;
+                }
+                emit(x0, c);
+            }
+        }
+    }
+    int weight(int x0, int x1, int r) const {
+        return x1 - x0 + 1;
+    }
+    float weight_scale() const {
+        return 1.0f;
+    }
+};
+
+//  cells are set when occupancy reaches threshold, and weigh in by it
+struct OccupancySource {
+    unsigned char const *data;
+    int width;
+    unsigned char threshold;
+    template<typename Fn>
+    void runs(int r, Fn const &emit) const {
+        unsigned char const *row = data + r * width;
+        for (int c = 0; c < width; ++c) {
+            if (row[c] >= threshold) {
+                int x0 = c;
+                while (c + 1 < width && row[c + 1] >= threshold) {
+                    ++c;
+                }
+                emit(x0, c);
+            }
+        }
+    }
+    int weight(int x0, int x1, int r) const {
+        int sum = 0;
+        for (int c = x0; c <= x1; ++c) {
+            sum += data[r * width + c];
+        }
+        return sum;
+    }
+    float weight_scale() const {
+        return 1.0f / 255.0f;
+    }
+};
+
+//  Runs come from bit scanning whole 64-bit words, so clear cells are 
+//  never looked at one by one. The row padding bits are always 0.
+struct MaskSource {
+    unsigned char const *data;
+    int width;
+    int stride;
+    template<typename Fn>
+    void runs(int r, Fn const &emit) const {
+        unsigned char const *row = data + r * stride;
+        int open = -1;      //  start of a run that reached the end of a word
+        for (int w = 0; w < stride; w += 8) {
+            uint64_t bits;
+            memcpy(&bits, row + w, sizeof(bits));
+            int base = w << 3;
+            if (open >= 0 && !(bits & 1)) {
+                emit(open, base - 1);
+                open = -1;
+            }
+            while (bits) {
+                int b = __builtin_ctzll(bits);
+                uint64_t clear = ~bits & (~(uint64_t)0 << b);
+                int e = clear ? __builtin_ctzll(clear) : 64;
+                if (open < 0) {
+                    open = base + b;
+                }
+                if (e == 64) {
+                    break;
+                }
+                emit(open, base + e - 1);
+                open = -1;
+                bits &= ~(uint64_t)0 << e;
+            }
+        }
+        if (open >= 0) {
+            emit(open, width - 1);
+        }
+    }
+    int weight(int x0, int x1, int r) const {
+        return x1 - x0 + 1;
+    }
+    float weight_scale() const {
+        return 1.0f;
+    }
+};
+
+//  What labeling keeps for each provisional label; a root label holds its 
+//  whole cluster.
+struct LabelStats {
+    short minx;
+    short maxx;
+    short miny;
+    short maxy;
+    short topx;         //  leftmost cell of the top row, for a stable order
+    int count;
+    int weight;         //  in the source's weight units
+    int64_t sx;         //  sums of x, y, x*x, x*y, y*y over the cells
+    int64_t sy;
+    int64_t sxx;
+    int64_t sxy;
+    int64_t syy;
+};
+
+//  the moments of a run of cells x0..x1 in row r, in closed form
+static inline void add_run_moments(LabelStats &st, int64_t x0, int64_t x1, int64_t r) {
+    int64_t len = x1 - x0 + 1;
+    int64_t sc = (x0 + x1) * len / 2;
+    st.sx += sc;
+    st.sy += r * len;
+    st.sxx += (x1 * (x1 + 1) * (2 * x1 + 1) - (x0 - 1) * x0 * (2 * x0 - 1)) / 6;
+    st.sxy += r * sc;
+    st.syy += r * r * len;
+}
+
+//  Labels are handed out per band from disjoint ranges, so the bands can 
+//  be labeled at the same time. Each run gets at most one new label, so a 
+//  band needs no more labels than it can hold runs.
+static unsigned short *dlabel_parent;
+static unsigned short *dlabel_final;
+static LabelStats *dlabel_stats;
+static unsigned short *dlabel_order;
+static int dlabel_size;
+
+#define MAX_LABELS 65535
+
+//  Bands of the map labeled on separate cores; detect_label_threads in 
+//  camcam.ini. A band needs enough rows to pay for waking a thread.
+#define LABEL_MAX_THREADS 4
+#define LABEL_MIN_BAND_ROWS 16
+
+static int label_threads = 1;
+
+static bool reserve_label_tables(int run_count) {
+    int need = std::min(MAX_LABELS, run_count) + 1;
+    if (need > dlabel_size) {
+        free(dlabel_parent);
+        free(dlabel_stats);
+        dlabel_parent = (unsigned short *)malloc(sizeof(unsigned short) * need * 3);
+        dlabel_final = dlabel_parent ? dlabel_parent + need : NULL;
+        dlabel_order = dlabel_parent ? dlabel_final + need : NULL;
+        dlabel_stats = (LabelStats *)malloc(sizeof(LabelStats) * need);
+        dlabel_size = (dlabel_parent && dlabel_stats) ? need : 0;
+    }
+    return dlabel_size != 0;
+}
+
+//  with path halving, so chains stay short without a second walk
+static inline unsigned short find_label(unsigned short *parent, unsigned short l) {
+    while (parent[l] != l) {
+        parent[l] = parent[parent[l]];
+        l = parent[l];
+    }
+    return l;
+}
+
+//  Join the clusters of two labels. The lower label stays the root, so 
+//  the outcome doesn't depend on the order joins happen in.
+static unsigned short join_labels(unsigned short *parent, LabelStats *stats, unsigned short a, unsigned short b) {
+    a = find_label(parent, a);
+    b = find_label(parent, b);
+    if (a == b) {
+        return a;
+    }
+    if (b < a) {
+        std::swap(a, b);
+    }
+    parent[b] = a;
+    LabelStats &to = stats[a];
+    LabelStats const &from = stats[b];
+    if (from.miny < to.miny || (from.miny == to.miny && from.topx < to.topx)) {
+        to.topx = from.topx;
+    }
+    to.minx = std::min(to.minx, from.minx);
+    to.maxx = std::max(to.maxx, from.maxx);
+    to.miny = std::min(to.miny, from.miny);
+    to.maxy = std::max(to.maxy, from.maxy);
+    to.count += from.count;
+    to.weight += from.weight;
+    to.sx += from.sx;
+    to.sy += from.sy;
+    to.sxx += from.sxx;
+    to.sxy += from.sxy;
+    to.syy += from.syy;
+    return a;
+}
+
+//  rows r0..r1-1 of the map; runs and labels go in their own ranges
+struct LabelBand {
+    int r0;
+    int r1;
+    int runBase;
+    int runCap;
+    int numRuns;
+    int labelBase;
+    int labelEnd;       //  one past the last label used
+    int labelCap;
+    int errors;
+};
+
+//  Pull each row's runs from the source, and join each run to the runs it 
+//  overlaps in the row above (4-connected), so the work scales with the 
+//  set cells rather than the size of the map.
+template<typename Source>
+static void label_band(Source const &src, ClusterRun *allRuns, LabelBand &band) {
+    unsigned short *parent = dlabel_parent;
+    LabelStats *stats = dlabel_stats;
+    ClusterRun *runs = allRuns + band.runBase;
+    int num_runs = 0;
+    int next = band.labelBase;
+    int labelEnd = band.labelBase + band.labelCap;
+    int above = 0, aboveEnd = 0;     //  the runs of the row above
+    band.errors = 0;
+    for (int r = band.r0; r < band.r1; ++r) {
+        int rowStart = num_runs;
+        int a = above;
+        src.runs(r, [&](int x0, int x1) {
+            if (num_runs == band.runCap) {
+                band.errors += x1 - x0 + 1;
+                return;
+            }
+            unsigned short cur = 0;
+            while (a != aboveEnd && runs[a].x1 < x0) {
+                ++a;
+            }
+            for (int k = a; k != aboveEnd && runs[k].x0 <= x1; ++k) {
+                if (runs[k].label) {
+                    cur = cur ? join_labels(parent, stats, cur, runs[k].label) : find_label(parent, runs[k].label);
+                }
+            }
+            if (cur) {
+                LabelStats &st = stats[cur];
+                st.minx = std::min((int)st.minx, x0);
+                st.maxx = std::max((int)st.maxx, x1);
+                st.maxy = r;
+                st.count += x1 - x0 + 1;
+                st.weight += src.weight(x0, x1, r);
+                add_run_moments(st, x0, x1, r);
+            } else if (next != labelEnd) {
+                cur = next++;
+                parent[cur] = cur;
+                LabelStats &st = stats[cur];
+                st.minx = st.topx = x0;
+                st.maxx = x1;
+                st.miny = st.maxy = r;
+                st.count = x1 - x0 + 1;
+                st.weight = src.weight(x0, x1, r);
+                st.sx = st.sy = st.sxx = st.sxy = st.syy = 0;
+                add_run_moments(st, x0, x1, r);
+            } else {
+                band.errors += x1 - x0 + 1;
+            }
+            ClusterRun &run = runs[num_runs++];
+            run.row = r;
+            run.x0 = x0;
+            run.x1 = x1;
+            run.label = cur;
+        });
+        above = rowStart;
+        aboveEnd = num_runs;
+    }
+    band.numRuns = num_runs;
+    band.labelEnd = next;
+}
+
+//  Band workers wait for a generation number to change, label their band, 
+//  and count themselves done; the calling thread labels band 0.
+struct LabelJob {
+    void (*fn)(LabelJob const *job, int band);
+    void const *src;
+    ClusterRun *runs;
+    LabelBand *bands;
+};
+
+static pthread_mutex_t label_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t label_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t label_done = PTHREAD_COND_INITIALIZER;
+static LabelJob const *label_job;
+static int label_job_bands;     //  workers past these sit the job out
+static unsigned int label_generation;
+static int label_pending;
+static int label_workers;       //  threads started, besides the caller
+static unsigned int label_worker_start[LABEL_MAX_THREADS];  //  the job before each one started
+
+template<typename Source>
+static void label_band_job(LabelJob const *job, int band) {
+    label_band(*(Source const *)job->src, job->runs, job->bands[band]);
+}
+
+static void *label_worker(void *arg) {
+    int band = (int)(intptr_t)arg;
+    unsigned int seen = label_worker_start[band];
+    while (true) {
+        LabelJob const *job;
+        {
+            PLock lock(label_lock);
+            while (label_generation == seen) {
+                pthread_cond_wait(&label_start, &label_lock);
+            }
+            seen = label_generation;
+            job = (band < label_job_bands) ? label_job : NULL;
+        }
+        if (!job) {
+            continue;
+        }
+        job->fn(job, band);
+        PLock lock(label_lock);
+        if (--label_pending == 0) {
+            pthread_cond_signal(&label_done);
+        }
+    }
+    return NULL;
+}
+
+//  how many bands to use; starts band workers as needed
+static int label_band_count(int height) {
+    int n = std::min(label_threads, height / LABEL_MIN_BAND_ROWS);
+    while (label_workers < n - 1) {
+        pthread_t thread;
+        label_worker_start[label_workers + 1] = label_generation;
+        if (pthread_create(&thread, NULL, label_worker, (void *)(intptr_t)(label_workers + 1))) {
+            fprintf(stderr, "Could not start cluster labeling thread\n");
+            break;
+        }
+        pthread_detach(thread);
+        ++label_workers;
+    }
+    return std::max(1, std::min(n, label_workers + 1));
+}
+
+int detect_set_label_threads(int threads) {
+    label_threads = std::max(1, std::min(LABEL_MAX_THREADS, threads));
+    return label_threads;
+}
+
+static void run_label_job(LabelJob const *job, int nbands) {
+    if (nbands > 1) {
+        PLock lock(label_lock);
+        label_job = job;
+        label_job_bands = nbands;
+        label_pending = nbands - 1;
+        ++label_generation;
+        pthread_cond_broadcast(&label_start);
+    }
+    job->fn(job, 0);
+    if (nbands > 1) {
+        PLock lock(label_lock);
+        while (label_pending) {
+            pthread_cond_wait(&label_done, &label_lock);
+        }
+    }
+}
+
+//  Build 4-connected clusters, and return those of at least min_size cells 
+//  ordered from the top of the map down (ties: larger first, then left 
+//  first.) Cluster i gets label i + 1, and so do its runs; runs of clusters 
+//  that were dropped get label 0. The map is split into horizontal bands 
+//  labeled in parallel, and then joined across the band borders, which 
+//  gives the same clusters, runs and order as labeling it in one piece.
+template<typename Source>
+static int detect_clusters_impl(
+        Source const &src,
+        int width,
+        int height,
+        ClusterRun *runs,
+        int run_count,
+        int *out_runs,
+        Cluster *output,
+        int output_count,
+        int min_size,
+        int *out_errors)
+{
+    *out_runs = 0;
+    if (!reserve_label_tables(run_count)) {
+        fprintf(stderr, "Could not allocate cluster label tables\n");
+        if (out_errors) {
+            *out_errors = 1;
+        }
+        return 0;
+    }
+    unsigned short *parent = dlabel_parent;
+    LabelStats *stats = dlabel_stats;
+
+    //  each band gets room for as many runs as its rows can hold, and 
+    //  labels numbered the same way, as far as the tables go
+    LabelBand bands[LABEL_MAX_THREADS];
+    int nbands = label_band_count(height);
+    int runsPerRow = (width + 1) / 2;
+    for (int b = 0; b != nbands; ++b) {
+        LabelBand &band = bands[b];
+        band.r0 = height * b / nbands;
+        band.r1 = height * (b + 1) / nbands;
+        band.runBase = std::min(run_count, band.r0 * runsPerRow);
+        band.runCap = std::min(run_count, band.r1 * runsPerRow) - band.runBase;
+        band.labelBase = 1 + std::min(dlabel_size - 1, band.runBase);
+        band.labelCap = std::min(dlabel_size, 1 + band.runBase + band.runCap) - band.labelBase;
+    }
+    if (nbands == 1) {
+        bands[0].runCap = run_count;
+        bands[0].labelCap = dlabel_size - 1;
+    }
+    LabelJob job = { &label_band_job<Source>, &src, runs, bands };
+    run_label_job(&job, nbands);
+
+    //  join clusters across band borders: the last row of one band and the 
+    //  first row of the next
+    int num_errors = 0;
+    for (int b = 0; b != nbands; ++b) {
+        num_errors += bands[b].errors;
+        if (b == 0) {
+            continue;
+        }
+        ClusterRun const *up = runs + bands[b-1].runBase;
+        int ue = bands[b-1].numRuns;
+        int u = ue;
+        while (u > 0 && up[u-1].row == bands[b].r0 - 1) {
+            --u;
+        }
+        ClusterRun const *down = runs + bands[b].runBase;
+        int de = bands[b].numRuns;
+        for (int d = 0; d != de && down[d].row == bands[b].r0; ++d) {
+            while (u != ue && up[u].x1 < down[d].x0) {
+                ++u;
+            }
+            for (int k = u; k != ue && up[k].x0 <= down[d].x1; ++k) {
+                if (up[k].label && down[d].label) {
+                    join_labels(parent, stats, up[k].label, down[d].label);
+                }
+            }
+        }
+    }
+
+    //  big enough clusters, in order
+    int ncand = 0;
+    for (int b = 0; b != nbands; ++b) {
+        for (int l = bands[b].labelBase; l != bands[b].labelEnd; ++l) {
+            dlabel_final[l] = 0;
+            if (parent[l] == l && stats[l].count >= min_size) {
+                dlabel_order[ncand++] = l;
+            }
+        }
+    }
+    std::sort(dlabel_order, dlabel_order + ncand, [stats](unsigned short a, unsigned short b) {
+            LabelStats const &sa = stats[a];
+            LabelStats const &sb = stats[b];
+            if (sa.miny != sb.miny) {
+                return sa.miny < sb.miny;
+            }
+            if (sa.count != sb.count) {
+                return sa.count > sb.count;
+            }
+            return sa.topx < sb.topx;
+        });
+    int num_clusters = std::min(ncand, output_count);
+    if (ncand > output_count) {
+        fprintf(stderr, "Too many indifidual clusters: %d\n", ncand);
+        num_errors += ncand - output_count;
+    }
+    float scale = src.weight_scale();
+    for (int i = 0; i != num_clusters; ++i) {
+        int l = dlabel_order[i];
+        LabelStats const &st = stats[l];
+        Cluster &cl = output[i];
+        cl.minx = st.minx;
+        cl.maxx = st.maxx;
+        cl.miny = st.miny;
+        cl.maxy = st.maxy;
+        cl.count = st.count;
+        cl.weight = st.weight * scale;
+        double n = st.count;
+        double mx = st.sx / n, my = st.sy / n;
+        cl.cx = (float)mx;
+        cl.cy = (float)my;
+        cl.cxx = (float)(st.sxx / n - mx * mx);
+        cl.cxy = (float)(st.sxy / n - mx * my);
+        cl.cyy = (float)(st.syy / n - my * my);
+        cl.label = i + 1;
+        dlabel_final[l] = i + 1;
+    }
+
+    //  final labels, and the bands' runs made contiguous
+    int num_runs = 0;
+    for (int b = 0; b != nbands; ++b) {
+        ClusterRun *br = runs + bands[b].runBase;
+        for (int i = 0; i != bands[b].numRuns; ++i) {
+            ClusterRun run = br[i];
+            if (run.label) {
+                run.label = dlabel_final[find_label(parent, run.label)];
+            }
+            runs[num_runs++] = run;
+        }
+    }
+    *out_runs = num_runs;
+    if (out_errors) {
+        *out_errors = num_errors;
+    }
+    return num_clusters;
+}
+
+int detect_clusters(
+        unsigned char label,
+        unsigned char const *input,
+        int width,
+        int height,
+        ClusterRun *runs,
+        int run_count,
+        int *out_runs,
+        Cluster *output,
+        int output_count,
+        int min_size,
+        int *out_errors)
+{
+    ByteSource src = { input, width, label };
+    return detect_clusters_impl(src, width, height, runs, run_count, out_runs, output, output_count, min_size, out_errors);
+}
+
+//  the same, for set pixels in a 1bpp mask
+int detect_clusters_mask(
+        unsigned char const *input,
+        int width,
+        int height,
+        ClusterRun *runs,
+        int run_count,
+        int *out_runs,
+        Cluster *output,
+        int output_count,
+        int min_size,
+        int *out_errors)
+{
+    MaskSource src = { input, width, MASK_STRIDE(width) };
+    return detect_clusters_impl(src, width, height, runs, run_count, out_runs, output, output_count, min_size, out_errors);
+}
+
+int detect_clusters_occupancy(
+        unsigned char threshold,
+        unsigned char const *input,
+        int width,
+        int height,
+        ClusterRun *runs,
+        int run_count,
+        int *out_runs,
+        Cluster *output,
+        int output_count,
+        int min_size,
+        int *out_errors)
+{
+    OccupancySource src = { input, width, threshold };
+    return detect_clusters_impl(src, width, height, runs, run_count, out_runs, output, output_count, min_size, out_errors);
+}
+
+static void detect_project_fused(ProjectSamples const *ps, unsigned char const *bptr, int width, int height,
+        unsigned char *scratch, unsigned char *mask, unsigned char *bytes);
+
+//  The steering gains were tuned on an evenly spaced map, so steering 
+//  works in its units: cells of the near resolution, with rows counted 
+//  from where the far edge of an evenly spaced map would be.
+static inline float even_col(float groundX) {
+    return groundX / dproject->resolution + PROJECT_WIDTH * 0.5f - 0.5f;
+}
+
+static inline float even_row(float groundY) {
+    return (PROJECT_HEIGHT - 1) - (groundY - dproject->nearY) / dproject->resolution;
+}
+
+//  how many even rows one map row spans at a (fractional) map row
+static inline float even_row_scale(float row) {
+    int r = std::max(0, std::min(dproject->height - 2, (int)floorf(row)));
+    return (dproject->groundYPerScanline[r] - dproject->groundYPerScanline[r + 1]) / dproject->resolution;
+}
+
+//  A line segment in the ideal camera image, from an elongated cluster.
+struct PitchSegment {
+    float x0, y0, x1, y1;
+    float weight;
+    int minRow, maxRow;     //  in the flat map
+    float col;
+};
+
+//  fractional flat map cell to ideal camera image, by the scanline tables
+static void cell_to_image(ProjectData const *pd, float col, float row, float *ox, float *oy) {
+    int r = std::max(0, std::min(pd->height - 2, (int)floorf(row)));
+    float f = row - r;
+    float y = pd->yPerScanline[r] * (1.0f - f) + pd->yPerScanline[r+1] * f;
+    float x0 = pd->xPerScanline[r] + pd->incrementPerScanline[r] * col;
+    float x1 = pd->xPerScanline[r+1] + pd->incrementPerScanline[r+1] * col;
+    *ox = x0 * (1.0f - f) + x1 * f;
+    *oy = y;
+}
+
+int cluster_axis(Cluster const *cl, float *major, float *minor, float *ax, float *ay) {
+    float mid = (cl->cxx + cl->cyy) * 0.5f;
+    float dif = sqrtf((cl->cxx - cl->cyy) * (cl->cxx - cl->cyy) * 0.25f + cl->cxy * cl->cxy);
+    *major = mid + dif;
+    *minor = std::max(0.0f, mid - dif);
+    float x = cl->cxy, y = *major - cl->cxx;
+    if (fabsf(x) + fabsf(y) < 1e-6f) {
+        //  lying along x (or round)
+        x = 1.0f;
+        y = 0.0f;
+    }
+    float len = sqrtf(x * x + y * y);
+    *ax = x / len;
+    *ay = y / len;
+    return *major >= 4.0f * *minor + 1.0f;
+}
+
+//  the principal axis of each elongated cluster, from the moments the 
+//  labeler gathered
+static int pitch_segments(Cluster const *cl, int n, PitchSegment *out) {
+    int ns = 0;
+    for (int i = 0; i != n && ns != PITCH_MAX_SEGMENTS; ++i) {
+        if (cl[i].count < MIN_CLUSTER_SIZE) {
+            continue;
+        }
+        float major, minor, ax, ay;
+        if (!cluster_axis(&cl[i], &major, &minor, &ax, &ay) || major < PITCH_MIN_LENGTH * PITCH_MIN_LENGTH / 12.0f) {
+            //  a blob or a speck; no direction to speak of
+            continue;
+        }
+        //  half length of a uniform bar with this variance
+        float half = sqrtf(3.0f * major);
+        ax *= half;
+        ay *= half;
+        float mx = cl[i].cx, my = cl[i].cy;
+        PitchSegment &ps = out[ns++];
+        cell_to_image(dproject, mx - ax, my - ay, &ps.x0, &ps.y0);
+        cell_to_image(dproject, mx + ax, my + ay, &ps.x1, &ps.y1);
+        ps.weight = cl[i].count;
+        ps.minRow = cl[i].miny;
+        ps.maxRow = cl[i].maxy;
+        ps.col = mx;
+    }
+    return ns;
+}
+
+//  Segments one after the other along a line (or a curve) say nothing 
+//  about pitch; it takes two side by side.
+static bool segments_side_by_side(PitchSegment const *seg, int n) {
+    for (int i = 0; i != n; ++i) {
+        for (int j = i + 1; j != n; ++j) {
+            int overlap = std::min(seg[i].maxRow, seg[j].maxRow) - std::max(seg[i].minRow, seg[j].minRow);
+            if (overlap >= PITCH_MIN_LENGTH / 2 && fabsf(seg[i].col - seg[j].col) >= PITCH_MIN_LENGTH) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//  weighted variance of the ground directions of the segments, at a pitch
+static float pitch_cost(PitchSegment const *seg, int n, float pitch) {
+    float sw = 0, sa = 0, saa = 0;
+    for (int i = 0; i != n; ++i) {
+        float gx0, gy0, gx1, gy1;
+        if (project_image_to_ground(&dparams, pitch, seg[i].x0, seg[i].y0, &gx0, &gy0) ||
+                project_image_to_ground(&dparams, pitch, seg[i].x1, seg[i].y1, &gx1, &gy1)) {
+            continue;
+        }
+        if (gy1 < gy0) {
+            std::swap(gx0, gx1);
+            std::swap(gy0, gy1);
+        }
+        float a = atan2f(gx1 - gx0, gy1 - gy0);
+        sw += seg[i].weight;
+        sa += a * seg[i].weight;
+        saa += a * a * seg[i].weight;
+    }
+    if (sw <= 0) {
+        return 0;
+    }
+    float ma = sa / sw;
+    return saa / sw - ma * ma;
+}
+
+//  Lines that are parallel on the ground only look parallel in the flat map 
+//  when the plan has the right pitch; suspension pitch under acceleration 
+//  moves it. Find the pitch that makes the segments agree best, filter it, 
+//  and re-aim the plan for the next frame when it has moved enough. This 
+//  assumes the visible lines are parallel (a straight track); on curves the 
+//  estimate wanders, which the range limit and filter keep in check.
+static void track_pitch(Cluster const *cl, int n) {
+    PitchSegment seg[PITCH_MAX_SEGMENTS];
+    int ns = pitch_segments(cl, n, seg);
+    if (ns < 2 || !segments_side_by_side(seg, ns)) {
+        return;
+    }
+    float const g = 0.6180340f;
+    float lo = ANGLED_DOWN_RADIANS - PITCH_RANGE;
+    float hi = ANGLED_DOWN_RADIANS + PITCH_RANGE;
+    float a = hi - (hi - lo) * g;
+    float b = lo + (hi - lo) * g;
+    float fa = pitch_cost(seg, ns, a);
+    float fb = pitch_cost(seg, ns, b);
+    for (int i = 0; i != 24; ++i) {
+        if (fa < fb) {
+            hi = b;
+            b = a;
+            fb = fa;
+            a = hi - (hi - lo) * g;
+            fa = pitch_cost(seg, ns, a);
+        } else {
+            lo = a;
+            a = b;
+            fa = fb;
+            b = lo + (hi - lo) * g;
+            fb = pitch_cost(seg, ns, b);
+        }
+    }
+    dpitch_filtered += ((lo + hi) * 0.5f - dpitch_filtered) * PITCH_SMOOTHING;
+    if (fabsf(dpitch_filtered - dpitch) < PITCH_REPLAN) {
+        return;
+    }
+    if (project_set_pitch(&dparams, dproject, dpitch_filtered)) {
+        return;
+    }
+    dpitch = dpitch_filtered;
+    if (dfootprint && update_project_footprint(&dparams, dproject, dfootprint)) {
+        fprintf(stderr, "Could not update projection footprint plan; using nearest samples\n");
+        free_project_footprint(dfootprint);
+        dfootprint = NULL;
+    }
+}
+
+float detect_get_pitch() {
+    return dpitch;
+}
+
+//  Follow clusters from frame to frame. Each track predicts where its 
+//  cluster's centroid will be on the ground, and takes the nearest cluster 
+//  within a gate around that (greedily, nearest pairs first.) Tracks that 
+//  find no cluster coast on their velocity for a few frames; clusters that 
+//  find no track start new ones.
+ClusterTrack g_tracks[MAX_TRACKS];
+int g_num_tracks;
+static int track_next_id = 1;
+
+struct TrackPair {
+    float d2;
+    short track;
+    short cluster;
+};
+
+static TrackPair track_pairs[MAX_TRACKS * MAX_TRACKS];
+static short track_pick[MAX_CLUSTERS];     //  cluster index, by slot
+static float track_cx[MAX_TRACKS];
+static float track_cy[MAX_TRACKS];
+static bool track_taken[MAX_TRACKS];
+
+//  With more clusters than tracks, follow the biggest ones: clusters come 
+//  far ones first, and those are the small ones, while the near ones are 
+//  what steering needs. The picks stay in cluster order.
+static int pick_tracked_clusters(Cluster const *cl, int n) {
+    for (int j = 0; j != n; ++j) {
+        track_pick[j] = (short)j;
+    }
+    if (n > MAX_TRACKS) {
+        std::partial_sort(track_pick, track_pick + MAX_TRACKS, track_pick + n, [cl](short a, short b) {
+                if (cl[a].weight != cl[b].weight) {
+                    return cl[a].weight > cl[b].weight;
+                }
+                return a < b;
+            });
+        n = MAX_TRACKS;
+        std::sort(track_pick, track_pick + n);
+    }
+    return n;
+}
+
+static void track_clusters(Cluster const *cl, int ncl) {
+    int n = pick_tracked_clusters(cl, ncl);
+    for (int i = 0; i != g_num_tracks; ++i) {
+        ClusterTrack &t = g_tracks[i];
+        t.x += t.vx;
+        t.y += t.vy;
+        t.cluster = -1;
+    }
+    int npairs = 0;
+    for (int j = 0; j != n; ++j) {
+        Cluster const &c = cl[track_pick[j]];
+        project_cell_ground(dproject, c.cx, c.cy, &track_cx[j], &track_cy[j]);
+        track_taken[j] = false;
+        float gx = TRACK_GATE + (c.maxx - c.minx + 1) * 0.5f * dproject->resolution;
+        float gy = TRACK_GATE + (c.groundFar - c.groundNear) * 0.5f;
+        for (int i = 0; i != g_num_tracks; ++i) {
+            float dx = track_cx[j] - g_tracks[i].x;
+            float dy = track_cy[j] - g_tracks[i].y;
+            if (fabsf(dx) <= gx && fabsf(dy) <= gy) {
+                TrackPair &tp = track_pairs[npairs++];
+                tp.d2 = dx * dx + dy * dy;
+                tp.track = i;
+                tp.cluster = j;
+            }
+        }
+    }
+    std::sort(track_pairs, track_pairs + npairs, [](TrackPair const &a, TrackPair const &b) {
+            if (a.d2 != b.d2) {
+                return a.d2 < b.d2;
+            }
+            if (a.track != b.track) {
+                return a.track < b.track;
+            }
+            return a.cluster < b.cluster;
+        });
+    for (int k = 0; k != npairs; ++k) {
+        ClusterTrack &t = g_tracks[track_pairs[k].track];
+        int j = track_pairs[k].cluster;
+        if (t.cluster >= 0 || track_taken[j]) {
+            continue;
+        }
+        track_taken[j] = true;
+        float rx = track_cx[j] - t.x;
+        float ry = track_cy[j] - t.y;
+        t.x += rx * TRACK_ALPHA;
+        t.y += ry * TRACK_ALPHA;
+        t.vx += rx * TRACK_BETA;
+        t.vy += ry * TRACK_BETA;
+        t.cluster = track_pick[j];
+        t.age += 1;
+        t.missed = 0;
+    }
+    int nt = 0;
+    for (int i = 0; i != g_num_tracks; ++i) {
+        ClusterTrack &t = g_tracks[i];
+        if (t.cluster < 0 && ++t.missed > TRACK_COAST) {
+            continue;
+        }
+        g_tracks[nt++] = t;
+    }
+    for (int j = 0; j != n && nt != MAX_TRACKS; ++j) {
+        if (track_taken[j]) {
+            continue;
+        }
+        ClusterTrack &t = g_tracks[nt++];
+        t.id = track_next_id++;
+        t.age = 1;
+        t.missed = 0;
+        t.cluster = track_pick[j];
+        t.x = track_cx[j];
+        t.y = track_cy[j];
+        t.vx = 0;
+        t.vy = 0;
+    }
+    g_num_tracks = nt;
+}
+
+//  Linear regression on X as function of Y, over all the cells of the 
+//  clusters: their moments stand in for the cells, so a long line pins 
+//  down the slope where a blob only gives a point.
+static bool fit_clusters(Cluster const *c, int n, float *oa, float *ob, DetectOutput *out) {
+    float sumx = 0;
+    float sumy = 0;
+    float weight = 0;
+    float sumx2 = 0;
+    float sumy2 = 0;
+    float sumxy = 0;
+    for (int i = 0; i != n; ++i) {
+        float count = c[i].weight;
+        float gx, gy;
+        project_cell_ground(dproject, c[i].cx, c[i].cy, &gx, &gy);
+        float x = even_col(gx);
+        float y = even_row(gy);
+        float ys = even_row_scale(c[i].cy);
+        sumx += x * count;
+        sumy += y * count;
+        sumxy += (x * y + c[i].cxy * ys) * count;
+        sumx2 += (x * x + c[i].cxx) * count;
+        sumy2 += (y * y + c[i].cyy * ys * ys) * count;
+        weight += count;
+    }
+    float div = (weight * sumy2 - sumy * sumy);
+    if (fabsf(div) < 1e-3f) {
+        return false;
+    }
+    float a = (sumx * sumy2 - sumy * sumxy) / div;
+    float b = (weight * sumxy - sumy * sumx) / div;
+    //  the weighted squared residual, from the same sums
+    float ss = sumx2 - 2 * a * sumx - 2 * b * sumxy + a * a * weight + 2 * a * b * sumy + b * b * sumy2;
+    *oa = a;
+    *ob = b;
+    out->fit_points = n;
+    out->fit_inliers = n;
+    out->fit_residual = sqrtf(std::max(0.0f, ss) / weight);
+    return true;
+}
+
+//  A robust line through the steering clusters' runs (each its middle 
+//  cell, weighted by length): lines from random pairs of points, the one 
+//  with the most weight within RANSAC_TOLERANCE wins, and is refined by 
+//  least squares over its inliers. The random sequence starts over each 
+//  frame, so the same picture always gives the same line. One big blob 
+//  off to the side only adds points far from the line the track edges 
+//  agree on.
+#define RANSAC_MAX_POINTS 1024
+#define RANSAC_ITERATIONS 96
+#define RANSAC_TOLERANCE 3.0f       //  even cells, across
+#define RANSAC_MIN_DY 4.0f          //  even rows between the two points
+#define RANSAC_TIME_US 400
+
+static bool steer_label[MAX_CLUSTERS + 1];
+static float ransac_x[RANSAC_MAX_POINTS];
+static float ransac_y[RANSAC_MAX_POINTS];
+static float ransac_w[RANSAC_MAX_POINTS];
+static float ransac_row_y[PROJECT_HEIGHT];
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//  weighted least squares of X on Y over the points within tolerance
+static bool ransac_refine(int n, float a, float b, float *oa, float *ob, int *oinliers, float *oresidual) {
+    float sw = 0, sx = 0, sy = 0, sxy = 0, syy = 0;
+    for (int i = 0; i != n; ++i) {
+        if (fabsf(ransac_x[i] - a - b * ransac_y[i]) <= RANSAC_TOLERANCE) {
+            float w = ransac_w[i];
+            sw += w;
+            sx += w * ransac_x[i];
+            sy += w * ransac_y[i];
+            sxy += w * ransac_x[i] * ransac_y[i];
+            syy += w * ransac_y[i] * ransac_y[i];
+        }
+    }
+    float div = sw * syy - sy * sy;
+    if (sw <= 0 || fabsf(div) < 1e-3f) {
+        return false;
+    }
+    a = (sx * syy - sy * sxy) / div;
+    b = (sw * sxy - sy * sx) / div;
+    int inliers = 0;
+    float ss = 0, ws = 0;
+    for (int i = 0; i != n; ++i) {
+        float d = ransac_x[i] - a - b * ransac_y[i];
+        if (fabsf(d) <= RANSAC_TOLERANCE) {
+            ++inliers;
+            ss += ransac_w[i] * d * d;
+            ws += ransac_w[i];
+        }
+    }
+    *oa = a;
+    *ob = b;
+    *oinliers = inliers;
+    *oresidual = ws > 0 ? sqrtf(ss / ws) : 0.0f;
+    return inliers >= 2;
+}
+
+static bool fit_runs_ransac(ClusterRun const *runs, int nruns, float *oa, float *ob, DetectOutput *out) {
+    uint64_t start = monotonic_us();
+    for (int r = 0; r != PROJECT_HEIGHT; ++r) {
+        float gx, gy;
+        project_cell_ground(dproject, 0, r, &gx, &gy);
+        ransac_row_y[r] = even_row(gy);
+    }
+    int nuse = 0;
+    for (int i = 0; i != nruns; ++i) {
+        if (steer_label[runs[i].label]) {
+            ++nuse;
+        }
+    }
+    //  every step'th run, if there are too many to look at
+    int step = (nuse + RANSAC_MAX_POINTS - 1) / RANSAC_MAX_POINTS;
+    int n = 0, k = 0;
+    for (int i = 0; i != nruns; ++i) {
+        ClusterRun const &run = runs[i];
+        if (!steer_label[run.label] || k++ % step) {
+            continue;
+        }
+        ransac_x[n] = (run.x0 + run.x1) * 0.5f;
+        ransac_y[n] = ransac_row_y[run.row];
+        ransac_w[n] = run.x1 - run.x0 + 1;
+        ++n;
+    }
+    if (n < 2) {
+        return false;
+    }
+    unsigned int seed = 12345;
+    float besta = 0, bestb = 0, bestScore = 0;
+    for (int it = 0; it != RANSAC_ITERATIONS; ++it) {
+        if (!(it & 15) && it && monotonic_us() - start > RANSAC_TIME_US) {
+            break;
+        }
+        seed = seed * 1103515245 + 12345;
+        int i = (seed >> 8) % n;
+        seed = seed * 1103515245 + 12345;
+        int j = (seed >> 8) % n;
+        float dy = ransac_y[j] - ransac_y[i];
+        if (fabsf(dy) < RANSAC_MIN_DY) {
+            continue;
+        }
+        float b = (ransac_x[j] - ransac_x[i]) / dy;
+        float a = ransac_x[i] - b * ransac_y[i];
+        float score = 0;
+        for (int p = 0; p != n; ++p) {
+            if (fabsf(ransac_x[p] - a - b * ransac_y[p]) <= RANSAC_TOLERANCE) {
+                score += ransac_w[p];
+            }
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            besta = a;
+            bestb = b;
+        }
+    }
+    int inliers = 0;
+    float residual = 0;
+    if (bestScore <= 0 || !ransac_refine(n, besta, bestb, oa, ob, &inliers, &residual)) {
+        return false;
+    }
+    out->fit_points = n;
+    out->fit_inliers = inliers;
+    out->fit_residual = residual;
+    return true;
+}
+
+//  Pure pursuit: fit a path X = c0 + c1 Y + c2 Y^2 on the ground (in the 
+//  units of the camera height, ahead and to the right of the camera) to 
+//  the steering clusters' runs, pick the point on it a lookahead distance 
+//  away, and steer onto the circle through it. The lookahead grows with 
+//  the last drive command (whichever way it was steered,) so a faster 
+//  rover turns in earlier and more gently. The path is a line when the runs don't span enough depth to 
+//  bend it, and the target stays within the depth they span.
+#define PURSUIT_MIN_SPAN 15.0f      //  ground depth the runs must span for a curve
+
+static float steer_last_drive;      //  set by determine_steering_format()
+
+static bool solve3(double m[3][4], double *x) {
+    for (int i = 0; i != 3; ++i) {
+        int p = i;
+        for (int k = i + 1; k != 3; ++k) {
+            if (fabs(m[k][i]) > fabs(m[p][i])) {
+                p = k;
+            }
+        }
+        if (fabs(m[p][i]) < 1e-9) {
+            return false;
+        }
+        for (int j = 0; j != 4; ++j) {
+            std::swap(m[i][j], m[p][j]);
+        }
+        for (int k = 0; k != 3; ++k) {
+            if (k != i) {
+                double f = m[k][i] / m[i][i];
+                for (int j = i; j != 4; ++j) {
+                    m[k][j] -= f * m[i][j];
+                }
+            }
+        }
+    }
+    for (int i = 0; i != 3; ++i) {
+        x[i] = m[i][3] / m[i][i];
+    }
+    return true;
+}
+
+static bool steer_pursuit(Cluster const *c, ClusterRun const *runs, int nruns, DetectOutput *out) {
+    //  sums of w * y^k for k up to 4, and w * x * y^k up to 2, around a 
+    //  middle depth so the normal equations stay well conditioned
+    double sw = 0, sy[5] = { 0 }, sxy[3] = { 0 };
+    float ymin = 1e9f, ymax = -1e9f;
+    float y0 = dproject->nearY + dproject->height * dproject->resolution * 0.5f;
+    int n = 0;
+    for (int i = 0; i != nruns; ++i) {
+        ClusterRun const &run = runs[i];
+        if (!steer_label[run.label]) {
+            continue;
+        }
+        float gx, gy;
+        project_cell_ground(dproject, (run.x0 + run.x1) * 0.5f, run.row, &gx, &gy);
+        double w = run.x1 - run.x0 + 1;
+        double y = gy - y0;
+        double yk = 1;
+        for (int k = 0; k != 5; ++k) {
+            sy[k] += w * yk;
+            if (k < 3) {
+                sxy[k] += w * gx * yk;
+            }
+            yk *= y;
+        }
+        sw += w;
+        ymin = std::min(ymin, gy);
+        ymax = std::max(ymax, gy);
+        ++n;
+    }
+    if (n < 2 || ymax - ymin < 1.0f) {
+        return false;
+    }
+    double coef[3] = { 0, 0, 0 };
+    if (ymax - ymin >= PURSUIT_MIN_SPAN) {
+        double m[3][4] = {
+            { sy[0], sy[1], sy[2], sxy[0] },
+            { sy[1], sy[2], sy[3], sxy[1] },
+            { sy[2], sy[3], sy[4], sxy[2] },
+        };
+        if (!solve3(m, coef)) {
+            return false;
+        }
+    } else {
+        double div = sy[0] * sy[2] - sy[1] * sy[1];
+        if (fabs(div) < 1e-9) {
+            return false;
+        }
+        coef[0] = (sxy[0] * sy[2] - sy[1] * sxy[1]) / div;
+        coef[1] = (sy[0] * sxy[1] - sy[1] * sxy[0]) / div;
+    }
+    //  the point on the path at the lookahead distance, by bisection on 
+    //  depth, kept to where there were runs
+    float look = pursuit_lookahead + pursuit_lookahead_speed * steer_last_drive;
+    float lo = ymin, hi = ymax;
+    for (int it = 0; it != 16; ++it) {
+        float y = (lo + hi) * 0.5f;
+        float dy = y - y0;
+        float x = coef[0] + coef[1] * dy + coef[2] * dy * dy;
+        if (x * x + y * y < look * look) {
+            lo = y;
+        } else {
+            hi = y;
+        }
+    }
+    float ty = (lo + hi) * 0.5f;
+    float tdy = ty - y0;
+    float tx = coef[0] + coef[1] * tdy + coef[2] * tdy * tdy;
+    //  curvature of the arc from here through the target, tangent to 
+    //  straight ahead, and the wheel angle that drives it
+    float l2 = tx * tx + ty * ty;
+    float kappa = 2.0f * tx / l2;
+    float angle = atanf(pursuit_wheelbase * kappa);
+    angle = std::max(-pursuit_max_angle, std::min(pursuit_max_angle, angle));
+
+    //  slow down for sharp turns, and when the path ends close by
+    float topBlobY = std::max(0.0f, even_row(c[0].groundFar)) / PROJECT_HEIGHT;
+    float speed = 2.5f * (1.0f - topBlobY) * (1.0f - 0.5f * fabsf(angle) / pursuit_max_angle);
+    speed = std::max(0.2f, speed * speed_gain);
+    out->steer = pursuit_gain * angle;
+    out->drive = speed;
+    return true;
+}
+
+//  The ground map is a GROUND_MAP_CELLS square ring buffer of cells of 
+//  PROJECT_RESOLUTION, fixed to the world, holding how often each cell was 
+//  seen set (0 to 255.) World cell (i, j) lives at (j & mask, i & mask), 
+//  and the map covers the window of world cells around the rover; as the 
+//  rover moves the window moves, and only the rows and columns it moves 
+//  onto are cleared, so nothing is copied. Each frame, the cells of the 
+//  flat map the camera sees are turned into world cells by the rover pose 
+//  and blended in.
+#define GROUND_MAP_CELLS 256
+#define GROUND_MAP_MASK (GROUND_MAP_CELLS - 1)
+#define GROUND_MAP_BLEND 2          //  each look moves a cell 1/4 of the way
+
+static unsigned char ground_map[GROUND_MAP_CELLS * GROUND_MAP_CELLS];
+static int ground_map_x0 = INT32_MIN;   //  world cell at the window's corner
+static int ground_map_y0;
+static float rover_x, rover_y;          //  world position, ground units
+static float rover_heading;             //  radians clockwise from world +y
+static unsigned int odometry_m1, odometry_m2;
+static unsigned int odometry_used_m1, odometry_used_m2;
+static bool odometry_known;
+
+int detect_set_ground_map(int enabled) {
+    int old = ground_map_enabled;
+    ground_map_enabled = enabled != 0;
+    return old;
+}
+
+void detect_set_odometry(unsigned int m1, unsigned int m2) {
+    odometry_m1 = m1;
+    odometry_m2 = m2;
+    if (!odometry_known) {
+        odometry_used_m1 = m1;
+        odometry_used_m2 = m2;
+        odometry_known = true;
+    }
+}
+
+//  rover frame (x right, y ahead) to world, in ground units
+static inline void rover_to_world(float gx, float gy, float *wx, float *wy) {
+    float c = cosf(rover_heading), s = sinf(rover_heading);
+    *wx = rover_x + gx * c + gy * s;
+    *wy = rover_y - gx * s + gy * c;
+}
+
+static inline int world_cell(float w) {
+    return (int)floorf(w / PROJECT_RESOLUTION);
+}
+
+//  slide the window so the rover is in its middle, clearing what it 
+//  slides onto
+static void scroll_ground_map() {
+    int x0 = world_cell(rover_x) - GROUND_MAP_CELLS / 2;
+    int y0 = world_cell(rover_y) - GROUND_MAP_CELLS / 2;
+    if (ground_map_x0 == INT32_MIN || abs(x0 - ground_map_x0) >= GROUND_MAP_CELLS || abs(y0 - ground_map_y0) >= GROUND_MAP_CELLS) {
+        memset(ground_map, 0, sizeof(ground_map));
+        ground_map_x0 = x0;
+        ground_map_y0 = y0;
+        return;
+    }
+    //  columns moving into view are the ones leaving it on the other side
+    for (int i = std::min(x0, ground_map_x0); i != std::max(x0, ground_map_x0); ++i) {
+        int col = (x0 > ground_map_x0 ? i + GROUND_MAP_CELLS : i) & GROUND_MAP_MASK;
+        for (int j = 0; j != GROUND_MAP_CELLS; ++j) {
+            ground_map[j * GROUND_MAP_CELLS + col] = 0;
+        }
+    }
+    for (int j = std::min(y0, ground_map_y0); j != std::max(y0, ground_map_y0); ++j) {
+        int row = (y0 > ground_map_y0 ? j + GROUND_MAP_CELLS : j) & GROUND_MAP_MASK;
+        memset(ground_map + row * GROUND_MAP_CELLS, 0, GROUND_MAP_CELLS);
+    }
+    ground_map_x0 = x0;
+    ground_map_y0 = y0;
+}
+
+//  move the rover by the wheel counts since the last frame (differential: 
+//  m1 left, m2 right), and blend this frame's set cells into the map
+static void update_ground_map(ClusterRun const *runs, int nruns) {
+    if (odometry_known) {
+        float dl = (int)(odometry_m1 - odometry_used_m1) * odometry_per_tick;
+        float dr = (int)(odometry_m2 - odometry_used_m2) * odometry_per_tick;
+        odometry_used_m1 = odometry_m1;
+        odometry_used_m2 = odometry_m2;
+        float turn = odometry_track > 0 ? (dl - dr) / odometry_track : 0.0f;
+        float mid = rover_heading + turn * 0.5f;
+        rover_x += (dl + dr) * 0.5f * sinf(mid);
+        rover_y += (dl + dr) * 0.5f * cosf(mid);
+        rover_heading += turn;
+    }
+    scroll_ground_map();
+    //  world position of each flat map cell, stepping along its row
+    float c = cosf(rover_heading), s = sinf(rover_heading);
+    float step = dproject->resolution / PROJECT_RESOLUTION;
+    int const *gather = dproject->gather;
+    int k = 0;
+    for (int r = 0; r != dproject->height; ++r) {
+        float gx, gy;
+        project_cell_ground(dproject, 0, r, &gx, &gy);
+        float wx, wy;
+        rover_to_world(gx, gy, &wx, &wy);
+        float fx = wx / PROJECT_RESOLUTION, fy = wy / PROJECT_RESOLUTION;
+        float dx = c * step, dy = -s * step;
+        while (k != nruns && runs[k].row < r) {
+            ++k;
+        }
+        for (int x = 0; x != dproject->width; ++x, fx += dx, fy += dy) {
+            if (gather && gather[r * dproject->width + x] == GATHER_MISSING) {
+                continue;
+            }
+            while (k != nruns && runs[k].row == r && runs[k].x1 < x) {
+                ++k;
+            }
+            bool set = k != nruns && runs[k].row == r && runs[k].x0 <= x;
+            int i = (int)floorf(fx), j = (int)floorf(fy);
+            //  far rows can reach past the window; don't wrap them around
+            if ((unsigned)(i - ground_map_x0) >= GROUND_MAP_CELLS || (unsigned)(j - ground_map_y0) >= GROUND_MAP_CELLS) {
+                continue;
+            }
+            unsigned char &cell = ground_map[(j & GROUND_MAP_MASK) * GROUND_MAP_CELLS + (i & GROUND_MAP_MASK)];
+            cell += ((set ? 255 : 0) - (int)cell) >> GROUND_MAP_BLEND;
+        }
+    }
+}
+
+float detect_ground_map_at(float gx, float gy) {
+    if (ground_map_x0 == INT32_MIN) {
+        return 0.0f;
+    }
+    float wx, wy;
+    rover_to_world(gx, gy, &wx, &wy);
+    int i = world_cell(wx), j = world_cell(wy);
+    if (i < ground_map_x0 || i >= ground_map_x0 + GROUND_MAP_CELLS || j < ground_map_y0 || j >= ground_map_y0 + GROUND_MAP_CELLS) {
+        return 0.0f;
+    }
+    return ground_map[(j & GROUND_MAP_MASK) * GROUND_MAP_CELLS + (i & GROUND_MAP_MASK)] * (1.0f / 255.0f);
+}
+
+void detect_ground_map_view(unsigned char *dst, int width, int height) {
+    for (int v = 0; v != height; ++v) {
+        for (int u = 0; u != width; ++u) {
+            float gx = (u + 0.5f - width * 0.5f) * PROJECT_RESOLUTION;
+            float gy = (height * 0.5f - v - 0.5f) * PROJECT_RESOLUTION;
+            *dst++ = (unsigned char)(detect_ground_map_at(gx, gy) * 255.0f + 0.5f);
+        }
+    }
+}
+
+//  the gains and limits from camcam.ini, on a raw turn and speed
+static void finish_steering(float turn, float speed, DetectOutput *out) {
+    turn = turn * turn * turn_squared_gain * ((turn < 0) ? -1 : 1) + turn * turn_gain;
+    speed = speed * speed_gain;
+
+    turn = turn * (1 + speed);
+    if (speed < 0.2f) {
+        speed = 0.2f;
+    }
+    out->steer = turn;
+    out->drive = speed;
+}
+
+//  A Hough transform of every set cell of the flat map (by way of the 
+//  runs, so dashes too small to be clusters still count) into a (rho, 
+//  theta) grid, on the same evenly spaced axes as the steering line. 
+//  Votes are integer, with Q8 sin/cos tables; cells of a run step rho by 
+//  the cosine. The strongest few lines within 60 degrees of straight ahead 
+//  are averaged, by votes, into the X = a + bY that line steering uses.
+#define HOUGH_THETAS 64
+#define HOUGH_RHOS 256              //  2 cells each, rho -256 to 256
+#define HOUGH_MAX_LINES 4
+#define HOUGH_MIN_VOTES 12
+#define HOUGH_SUPPRESS_THETA 3
+#define HOUGH_SUPPRESS_RHO 4
+
+static unsigned short hough_acc[HOUGH_THETAS][HOUGH_RHOS];
+static int hough_cos[HOUGH_THETAS];
+static int hough_sin[HOUGH_THETAS];
+static int hough_row_y[PROJECT_HEIGHT];
+DetectLine g_lines[HOUGH_MAX_LINES];
+
+static void hough_tables() {
+    if (hough_cos[0]) {
+        return;
+    }
+    for (int t = 0; t != HOUGH_THETAS; ++t) {
+        float theta = t * 3.1415927f / HOUGH_THETAS;
+        hough_cos[t] = (int)floorf(cosf(theta) * 256.0f + 0.5f);
+        hough_sin[t] = (int)floorf(sinf(theta) * 256.0f + 0.5f);
+    }
+}
+
+static int steer_hough(ClusterRun const *runs, int nruns, DetectOutput *out) {
+    hough_tables();
+    for (int r = 0; r != PROJECT_HEIGHT; ++r) {
+        float gx, gy;
+        project_cell_ground(dproject, 0, r, &gx, &gy);
+        hough_row_y[r] = (int)floorf(even_row(gy) + 0.5f);
+    }
+    memset(hough_acc, 0, sizeof(hough_acc));
+    int toprow = PROJECT_HEIGHT;
+    for (int i = 0; i != nruns; ++i) {
+        ClusterRun const &run = runs[i];
+        int y = hough_row_y[run.row];
+        toprow = std::min(toprow, (int)run.row);
+        for (int t = 0; t != HOUGH_THETAS; ++t) {
+            //  rho in Q8, offset so bins start at 0
+            int rho = run.x0 * hough_cos[t] + y * hough_sin[t] + (256 << 8);
+            unsigned short *acc = hough_acc[t];
+            for (int x = run.x0; x <= run.x1; ++x, rho += hough_cos[t]) {
+                unsigned int bin = (unsigned int)rho >> 9;
+                if (bin < HOUGH_RHOS) {
+                    ++acc[bin];
+                }
+            }
+        }
+    }
+    int nlines = 0;
+    float sa = 0, sb = 0, sv = 0;
+    for (int k = 0; k != HOUGH_MAX_LINES; ++k) {
+        int best = 0, bt = 0, br = 0;
+        for (int t = 0; t != HOUGH_THETAS; ++t) {
+            for (int r = 0; r != HOUGH_RHOS; ++r) {
+                if (hough_acc[t][r] > best) {
+                    best = hough_acc[t][r];
+                    bt = t;
+                    br = r;
+                }
+            }
+        }
+        if (best < HOUGH_MIN_VOTES) {
+            break;
+        }
+        for (int t = std::max(0, bt - HOUGH_SUPPRESS_THETA); t <= std::min(HOUGH_THETAS - 1, bt + HOUGH_SUPPRESS_THETA); ++t) {
+            for (int r = std::max(0, br - HOUGH_SUPPRESS_RHO); r <= std::min(HOUGH_RHOS - 1, br + HOUGH_SUPPRESS_RHO); ++r) {
+                hough_acc[t][r] = 0;
+            }
+        }
+        float theta = bt * 3.1415927f / HOUGH_THETAS;
+        float ct = cosf(theta);
+        if (fabsf(ct) < 0.5f) {
+            //  across the path; says nothing about where it goes
+            continue;
+        }
+        float rho = br * 2 + 1 - 256;
+        DetectLine &l = g_lines[nlines++];
+        l.a = rho / ct;
+        l.b = -sinf(theta) / ct;
+        l.votes = best;
+        sa += l.a * best;
+        sb += l.b * best;
+        sv += best;
+    }
+    out->num_lines = nlines;
+    out->lines = g_lines;
+    if (!nlines) {
+        if (!complainedNoClusters) {
+            fprintf(stderr, "no lines! cannot steer\n");
+            complainedNoClusters = true;
+        }
+        out->steer = 0.4f;
+        out->drive = 0.5f;
+        return -3;
     }
+    if (complainedNoClusters) {
+        fprintf(stderr, "found lines for steering again\n");
+        complainedNoClusters = false;
+    }
+    float a = sa / sv;
+    float b = sb / sv;
+    float turn = (a * 2 - PROJECT_HEIGHT) / PROJECT_HEIGHT * INTERCEPT_GAIN - b * SLOPE_GAIN;
+    float topY = std::max(0, hough_row_y[toprow]) / (float)PROJECT_HEIGHT;
+    finish_steering(turn, 2.5f * (1.0f - topY), out);
     return 0;
 }
 
-//  build connected clusters
-int detect_clusters(
-        unsigned char label,
-        unsigned char const *input,
-        int width,
-        int height,
-        unsigned char *work_area,
-        Cluster *output,
-        int output_count,
-        int min_size,
-        int *out_errors)
-{
-    int num_clusters = 0;
-    int num_errors = 0;
-    Cluster *clust = NULL;
-    unsigned char cur_index = 0;
-    unsigned char const *src = input;
-    unsigned char *ptr = work_area;
-    for (int r = 0; r < height; ++r) {
-        clust = NULL;
-        for (int c = 0; c < width; ++c) {
-            unsigned char top_index = (r > 0) ? ptr[-width] : 0;
-            if (*src == label) {
-                //  I'm not already in a run-length cluster
-                if (!clust) {
-                    if (top_index) {
-                        cur_index = top_index;
-                        clust = &output[cur_index-1];
-                    } else {
-                        for (int i = num_clusters-1; i != -1; --i) {
-                            if (!output[i].label) {
-                                clust = &output[i];
-                                break;
-                            }
-                        }
-                        if (!clust) {
-                            if(num_clusters < output_count) {
-                                clust = &output[num_clusters];
-                                ++num_clusters;
-                                clust->label = num_clusters;
-                            }
-                        }
-                        if (clust) {
-                            cur_index = clust - output + 1;
-                            clust->minx = c;
-                            clust->maxx = c;
-                            clust->miny = r;
-                            clust->maxy = r;
-                            clust->count = 0;
-                            clust->label = cur_index;
-                        } else {
-                            fprintf(stderr, "Too many indifidual clusters: %d\n", num_clusters);
-                            ++num_errors;
-                            cur_index = 0;
-                        }
-                    }
-                }
-            } else {
-                clust = NULL;
-                cur_index = 0;
-            }
-            if (clust) {
-                clust->count++;
-                clust->maxx = std::max(clust->maxx, c);
-                clust->maxy = std::max(clust->maxy, r);
-                if (top_index && (top_index != cur_index)) {
-                    //  join these clusters
-                    Cluster *top = &output[top_index-1];
-                    top->minx = std::min(clust->minx, top->minx);
-                    top->miny = std::min(clust->miny, top->miny);
-                    top->maxx = std::max(clust->maxx, top->maxx);
-                    top->maxy = std::max(clust->maxy, top->maxy);
-                    top->count += clust->count;
-                    //  remove the current cluster
-                    int sc = clust->minx - c;
-                    int ec = clust->maxx - c;
-                    //  TODO: I could just mark these joined, and not actually 
-                    //  re-write the map until at the end. For very complex, 
-                    //  winding clusters, that might save some processing.
-                    for (int dr = clust->miny - r; dr <= 0; ++dr) {
-                        for (int dc = sc; dc <= ec; ++dc) {
-                            if (ptr[dc + dr * width] == cur_index) {
-                                ptr[dc + dr * width] = top_index;
-                            }
-                        }
-                    }
-                    clust->label = 0;
-                    clust->count = 0;
-                    clust = top;
-                    cur_index = top_index;
-                }
-            }
-            *ptr = cur_index;
-            ++src;
-            ++ptr;
-        }
-    }
-    for (int i = 0; i != num_clusters; ++i) {
-        if (!output[i].count || (output[i].count < min_size)) {
-            output[i].label = 0;
-        } else {
-            output[i].label = i + 1;
+//  the clusters of tracks seen for long enough, in cluster order
+static Cluster g_steer_clusters[MAX_TRACKS];
+static bool track_steers[MAX_CLUSTERS];
+
+static int tracked_clusters(Cluster const *cl, int n, Cluster *out) {
+    memset(track_steers, 0, sizeof(bool) * n);
+    for (int i = 0; i != g_num_tracks; ++i) {
+        ClusterTrack const &t = g_tracks[i];
+        if (t.cluster >= 0 && t.age >= TRACK_CONFIRM) {
+            track_steers[t.cluster] = true;
         }
     }
-    if (num_clusters > 0) {
-        std::sort(output, &output[num_clusters], [](Cluster const &a, Cluster const &b) {
-                if (a.label == 0) {
-                    return false;
-                }
-                if (b.label == 0) {
-                    return true;
-                }
-                int d = a.miny - b.miny;
-                if (d < 0) {
-                    return true;
-                }
-                if (d > 0) {
-                    return false;
-                }
-                if (a.count > b.count) {
-                    return true;
-                }
-                return false;
-            });
-        while (num_clusters > 0) {
-            if (!output[num_clusters-1].label) {
-                --num_clusters;
-            } else {
-                break;
-            }
+    int ns = 0;
+    for (int j = 0; j != n; ++j) {
+        if (track_steers[j]) {
+            out[ns++] = cl[j];
         }
     }
-    if (out_errors) {
-        *out_errors = num_errors;
+    return ns;
+}
+
+int detect_project_color(unsigned char const *yuv, int width, int height, unsigned char *dst, int format) {
+    if (!dproject || width != dproject->inWidth || height != dproject->inHeight) {
+        return -1;
     }
-    return num_clusters;
+    project_i420(dproject, yuv, dst, format);
+    return 0;
 }
 
 int determine_steering(unsigned char const *analyze_output, int width, int height, Frame *flatFrame, DetectOutput *out) {
+    return determine_steering_format(analyze_output, FRAME_FORMAT_GRAY, width, height, flatFrame, out);
+}
+
+static int steer_frame(unsigned char const *analyze_output, int format, int width, int height, Frame *flatFrame, DetectOutput *out);
+
+//  Whatever steered this frame (pursuit, the line, or a fallback,) its 
+//  drive command sets the next pursuit lookahead.
+int determine_steering_format(unsigned char const *analyze_output, int format, int width, int height, Frame *flatFrame, DetectOutput *out) {
+    int ret = steer_frame(analyze_output, format, width, height, flatFrame, out);
+    steer_last_drive = out->drive;
+    return ret;
+}
+
+static int steer_frame(unsigned char const *analyze_output, int format, int width, int height, Frame *flatFrame, DetectOutput *out) {
 
     out->steer = 0;
     out->drive = 0;
+    out->fit_points = 0;
+    out->fit_inliers = 0;
+    out->fit_residual = 0;
+    out->num_lines = 0;
+    out->lines = g_lines;
 
     //  project just to see if it works
     if (width != dwidth || height != dheight) {
@@ -249,23 +1690,117 @@ int determine_steering(unsigned char const *analyze_output, int width, int heigh
         params.inHeight = height;
         params.outWidth = PROJECT_WIDTH;
         params.outHeight = PROJECT_HEIGHT;
-        if (make_project_data(&params, &dproject) || !dproject) {
+        params.bakeGather = 1;
+        params.rowGrowth = project_row_growth;
+        params.k1 = project_k1;
+        params.k2 = project_k2;
+        params.p1 = project_p1;
+        params.p2 = project_p2;
+        if (make_project_data_cached(&params, PLAN_CACHE_DIR, &dproject) || !dproject) {
             fprintf(stderr, "Could not create deprojection plan!\n");
             dproject = NULL;
             return -1;
         }
+        free_project_samples(dsamples);
+        free(dsample_class);
+        dsamples = NULL;
+        dsample_class = NULL;
+        free_project_footprint(dfootprint);
+        free(dframe_mask);
+        dfootprint = NULL;
+        dframe_mask = NULL;
+        if (project_occupancy_threshold) {
+            if (make_project_footprint(&params, dproject, &dfootprint) || !dfootprint) {
+                fprintf(stderr, "Could not create projection footprint plan; using nearest samples\n");
+                dfootprint = NULL;
+            }
+        }
+        dparams = params;
+        dpitch = dpitch_filtered = params.angledDownRadians;
+        g_num_tracks = 0;
+        ground_map_x0 = INT32_MIN;
+        if (dfootprint || project_pitch_tracking) {
+            dframe_mask = (unsigned char *)malloc(MASK_SIZE(width, height));
+        }
+        if (make_project_samples(dproject, &dsamples) || !dsamples) {
+            fprintf(stderr, "Could not create deprojection sample plan!\n");
+            dsamples = NULL;
+        } else {
+            dsample_class = (unsigned char *)malloc(dsamples->count);
+            fprintf(stderr, "projection samples %d of %d source pixels\n", dsamples->count, width * height);
+        }
     }
     if (!dproject) {
         return -2;
     }
     unsigned char *flatOutput = flatFrame ? flatFrame->data_ : flat_map;
-    project_bitmap(dproject, analyze_output, flatOutput, 1);
     int n_errors = 0;
-    int n_clusters = detect_clusters(255, flatOutput, PROJECT_WIDTH, PROJECT_HEIGHT, flat_work, g_clusters, MAX_CLUSTERS, MIN_CLUSTER_SIZE, &n_errors);
+    int n_clusters = 0;
+    if (format == FRAME_FORMAT_YUV420 && dframe_mask) {
+        //  Occupancy needs every source pixel a cell covers, and the fused 
+        //  sample list doesn't follow a plan that moves with the pitch, so 
+        //  classify the whole frame.
+        detect_color_mask(analyze_output, dframe_mask, width, height);
+        analyze_output = dframe_mask;
+        format = FRAME_FORMAT_MASK;
+    }
+    if (dfootprint && format == FRAME_FORMAT_MASK) {
+        project_occupancy(dfootprint, analyze_output, flatOutput);
+        n_clusters = detect_clusters_occupancy(project_occupancy_threshold, flatOutput, PROJECT_WIDTH, PROJECT_HEIGHT,
+                g_runs, MAX_RUNS, &g_num_runs, g_clusters, MAX_CLUSTERS, MIN_CLUSTER_SIZE, &n_errors);
+    } else if (format == FRAME_FORMAT_YUV420) {
+        if (!dsamples) {
+            return -2;
+        }
+        detect_project_fused(dsamples, analyze_output, width, height, dsample_class, flat_mask, flatFrame ? flatOutput : NULL);
+        filter_flat_mask();
+        n_clusters = detect_clusters_mask(flat_mask, PROJECT_WIDTH, PROJECT_HEIGHT, g_runs, MAX_RUNS, &g_num_runs, g_clusters, MAX_CLUSTERS, MIN_CLUSTER_SIZE, &n_errors);
+    } else if (format == FRAME_FORMAT_MASK) {
+        project_mask(dproject, analyze_output, flat_mask, 1);
+        if (flatFrame) {
+            //  the GUI wants to see bytes
+            project_mask(dproject, analyze_output, flatOutput, 0);
+        }
+        filter_flat_mask();
+        n_clusters = detect_clusters_mask(flat_mask, PROJECT_WIDTH, PROJECT_HEIGHT, g_runs, MAX_RUNS, &g_num_runs, g_clusters, MAX_CLUSTERS, MIN_CLUSTER_SIZE, &n_errors);
+    } else {
+        project_bitmap(dproject, analyze_output, flatOutput, 1);
+        n_clusters = detect_clusters(255, flatOutput, PROJECT_WIDTH, PROJECT_HEIGHT, g_runs, MAX_RUNS, &g_num_runs, g_clusters, MAX_CLUSTERS, MIN_CLUSTER_SIZE, &n_errors);
+    }
     //  ignore the error of "too many clusters," if it happens at all (very unlikely)
-    Cluster const *const c = g_clusters;
+    for (int i = 0; i != n_clusters; ++i) {
+        Cluster &cl = g_clusters[i];
+        float gx0, gx1;
+        project_cell_ground(dproject, cl.minx, cl.maxy, &gx0, &cl.groundNear);
+        project_cell_ground(dproject, cl.maxx, cl.miny, &gx1, &cl.groundFar);
+        cl.groundX = (gx0 + gx1) * 0.5f;
+    }
+    track_clusters(g_clusters, n_clusters);
+    if (ground_map_enabled) {
+        update_ground_map(g_runs, g_num_runs);
+    }
+    if (project_pitch_tracking) {
+        track_pitch(g_clusters, n_clusters);
+    }
     out->num_clusters = n_clusters;
     out->clusters = g_clusters;
+    out->num_runs = g_num_runs;
+    out->runs = g_runs;
+    out->num_tracks = g_num_tracks;
+    out->tracks = g_tracks;
+    if (steer_detector == DETECTOR_HOUGH) {
+        return steer_hough(g_runs, g_num_runs, out);
+    }
+    //  one-frame specks don't steer; with no settled tracks yet (say, 
+    //  just after starting) all clusters do
+    Cluster const *c = g_clusters;
+    if (detect_track_steering) {
+        int nt = tracked_clusters(g_clusters, n_clusters, g_steer_clusters);
+        if (nt) {
+            c = g_steer_clusters;
+            n_clusters = nt;
+        }
+    }
     if (!n_clusters) {
         if (!complainedNoClusters) {
             fprintf(stderr, "no clusters! cannot steer\n");
@@ -280,61 +1815,47 @@ int determine_steering(unsigned char const *analyze_output, int width, int heigh
         complainedNoClusters = false;
     }
 
+    //  which runs belong to the steering clusters
+    memset(steer_label, 0, sizeof(bool) * (out->num_clusters + 1));
+    for (int i = 0; i != out->num_clusters; ++i) {
+        steer_label[i + 1] = (c == g_clusters) || track_steers[i];
+    }
+    if (steer_mode == STEER_PURSUIT && steer_pursuit(c, g_runs, g_num_runs, out)) {
+        return 0;
+    }
+
     float turn = 0.0f;
     float speed = 0.0f;
 
     if (n_clusters > 1) {
-        //  linear regression on X as function of Y
-        float sumx = 0;
-        float sumy = 0;
-        float weight = 0;
-        float sumx2 = 0;
-        float sumy2 = 0;
-        float sumxy = 0;
-        for (int i = 0; i != n_clusters; ++i) {
-            float count = c[i].count;
-            float x = (c[i].minx + c[i].maxx) * 0.5f;
-            sumx += x * count;
-            float y = (c[i].miny + c[i].miny) * 0.5f;
-            sumy += y * count;
-            sumxy += x * y * count;
-            sumx2 += x * x * count;
-            sumy2 += y * y * count;
-            weight += count;
-        }
-        float div = (weight * sumy2 - sumy * sumy);
-        if (fabsf(div) < 1e-3f) {
+        float a, b;
+        bool fit;
+        if (detect_robust_fit) {
+            fit = fit_runs_ransac(g_runs, g_num_runs, &a, &b, out) || fit_clusters(c, n_clusters, &a, &b, out);
+        } else {
+            fit = fit_clusters(c, n_clusters, &a, &b, out);
+        }
+        if (!fit) {
             //  horizontal? Pick the first cluster
             goto one_cluster;
         } else {
-            float a = (sumx * sumy2 - sumy * sumxy) / div;
-            float b = (weight * sumxy - sumy * sumx) / div;
             //  X = a + b Y
             //  turn towards intercept, and turn in direction of line
             turn = (a * 2 - PROJECT_HEIGHT) / PROJECT_HEIGHT * INTERCEPT_GAIN
                 - b * SLOPE_GAIN;
             //  how far can I see?
-            float topBlobY = float(c[0].miny) / PROJECT_HEIGHT;
+            float topBlobY = std::max(0.0f, even_row(c[0].groundFar)) / PROJECT_HEIGHT;
             speed = 2.5f * (1.0f - topBlobY);
         }
     } else {
 one_cluster:
         //  only one blob? turn towards it, I guess?
-        turn = 2.0f * float((c[0].minx + c[0].maxx) - PROJECT_WIDTH) / PROJECT_WIDTH;
-        turn = turn * (1.0f + (c[0].miny + c[0].maxy) / PROJECT_HEIGHT);
+        turn = 2.0f * (2.0f * even_col(c[0].groundX) - PROJECT_WIDTH) / PROJECT_WIDTH;
+        turn = turn * (1.0f + (int)floorf(even_row(c[0].groundFar) + even_row(c[0].groundNear) + 0.5f) / PROJECT_HEIGHT);
         speed = 0.7f;
     }
 
-    turn = turn * turn * turn_squared_gain * ((turn < 0) ? -1 : 1) + turn * turn_gain;
-    speed = speed * speed_gain;
-
-    turn = turn * (1 + speed);
-    if (speed < 0.2f) {
-        speed = 0.2f;
-    }
-    out->steer = turn;
-    out->drive = speed;
-
+    finish_steering(turn, speed, out);
     return 0;
 }
 
@@ -354,7 +1875,7 @@ static inline unsigned char classify(float y, float u, float v) {
     return 0;
 }
 
-void detect_color_inner(unsigned char const *bptr, unsigned char *dcls, int width, int height) {
+void detect_color_reference(unsigned char const *bptr, unsigned char *dcls, int width, int height) {
     unsigned char const *y = (unsigned char const *)bptr;
     unsigned char const *u = (unsigned char const *)(y + width * height);
     unsigned char const *v = (unsigned char const *)(u + width * height / 4);
@@ -380,6 +1901,630 @@ void detect_color_inner(unsigned char const *bptr, unsigned char *dcls, int widt
     }
 }
 
+//  The fast classifiers bake the detect_ settings into tables or constants.
+//  Each one keeps a copy of the settings it was built from, and rebuilds when 
+//  they change, which the GUI does while sliders are dragged. Several 
+//  threads classify at once (analyzer workers, and the steering step,) so 
+//  the check and rebuild happen under classifier_lock, once per frame; see 
+//  acquire_classifier().
+struct ClassifyParams {
+    float p[6];
+    bool built;
+};
+
+static pthread_mutex_t classifier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool classify_params_stale(ClassifyParams const &cp, float const *now) {
+    return !cp.built || memcmp(cp.p, now, sizeof(cp.p));
+}
+
+static void classify_params_set(ClassifyParams &cp, float const *now) {
+    memcpy(cp.p, now, sizeof(cp.p));
+    cp.built = true;
+}
+
+//  For a given U/V, classify() is a quadratic in Y that opens upwards (as 
+//  long as the gains are positive,) so the Y values that match form a 
+//  single interval. Store that interval for each U/V byte pair; lo > hi 
+//  means nothing matches.
+struct ClassifyRange {
+    unsigned char lo;
+    unsigned char hi;
+};
+
+//  constants for the fixed-point kernel; see FIXED_RADIUS below
+struct FixedConsts {
+    short yc;       //  detect_ycenter, 1/64ths
+    short cy;       //  sqrt(ygain / d2) * FIXED_RADIUS, 1/1024ths
+    short cc;       //  sqrt(cgain / d2) * FIXED_RADIUS, 1/1024ths
+    short bu;       //  ucenter / (ycenter + 20), 1/32768ths
+    short bv;       //  vcenter / (ycenter + 20), 1/32768ths
+};
+
+//  what one frame classifies with, from acquire_classifier()
+struct Classifier {
+    int kernel;
+    ClassifyRange const *table;
+    int tableIndex;
+    FixedConsts fixed;
+};
+
+//  A frame classifies from the table that was live when it started, so a 
+//  new table is built into the other one, and only when no frame still 
+//  uses that; then it goes live.
+static ClassifyRange classify_tables[2][256 * 256];
+static int classify_table_users[2];
+static int classify_table_live;
+static ClassifyParams classify_table_params;
+static bool classify_table_usable = false;
+
+static bool build_classify_table(ClassifyRange *out) {
+    if (!((detect_ygain > 0) && (detect_cgain >= 0) && (detect_ycenter + 20 > 0))) {
+        fprintf(stderr, "classify table: non-convex settings; using reference classifier\n");
+        return false;
+    }
+    //  d(y) = ygain (y - yc)^2 + cgain ((au - bu y)^2 + (av - bv y)^2)
+    float k = 1.0f / (detect_ycenter + 20);
+    float bu = detect_ucenter * k;
+    float bv = detect_vcenter * k;
+    float denom = detect_ygain + detect_cgain * (bu * bu + bv * bv);
+    for (int ui = 0; ui != 256; ++ui) {
+        float u = (float)ui - 128.0f;
+        float au = u - 20 * bu;
+        for (int vi = 0; vi != 256; ++vi) {
+            float v = (float)vi - 128.0f;
+            float av = v - 20 * bv;
+            float ymin = (detect_ygain * detect_ycenter + detect_cgain * (bu * au + bv * av)) / denom;
+            int yc = (int)floorf(ymin);
+            yc = std::max(0, std::min(255, yc));
+            if (!classify(yc, u, v) && (yc == 255 || !classify(++yc, u, v))) {
+                out->lo = 255;
+                out->hi = 0;
+            } else {
+                int lo = yc;
+                while (lo > 0 && classify(lo - 1, u, v)) {
+                    --lo;
+                }
+                int hi = yc;
+                while (hi < 255 && classify(hi + 1, u, v)) {
+                    ++hi;
+                }
+                out->lo = (unsigned char)lo;
+                out->hi = (unsigned char)hi;
+            }
+            ++out;
+        }
+    }
+    return true;
+}
+
+//  255 if lo <= y <= hi, else 0
+static inline unsigned char in_range(int y, int lo, int hi) {
+    return (unsigned char)~(((y - lo) | (hi - y)) >> 31);
+}
+
+//  with classifier_lock held; if a frame still uses the spare table, the 
+//  live one stays until a later frame
+static bool prepare_classify_table(float const *now) {
+    if (classify_params_stale(classify_table_params, now)) {
+        int spare = !classify_table_live;
+        if (!classify_table_users[spare]) {
+            classify_table_usable = build_classify_table(classify_tables[spare]);
+            classify_table_live = spare;
+            classify_params_set(classify_table_params, now);
+        }
+    }
+    return classify_table_usable;
+}
+
+static void classify_rows_table(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, Classifier const &cf) {
+    ClassifyRange const *table = cf.table;
+    for (int c = 0; c < width; c += 2) {
+        ClassifyRange cr = table[(*u << 8) | *v];
+        int lo = cr.lo;
+        int hi = cr.hi;
+        dcls[0] = in_range(y[0], lo, hi);
+        dcls[1] = in_range(y[1], lo, hi);
+        dcls[width] = in_range(y[width], lo, hi);
+        dcls[width+1] = in_range(y[width+1], lo, hi);
+        dcls += 2;
+        y += 2;
+        u++;
+        v++;
+    }
+}
+
+//  Fixed-point version of classify() for 16-bit SIMD lanes. Each of the 
+//  three terms is scaled so the d2 ellipsoid has radius FIXED_RADIUS, 
+//  clamped to 255 so its square fits in 16 unsigned bits, and the squares 
+//  are summed with saturation. Differences are kept in 1/64ths, and 
+//  mulhi() (a * b >> 16) applies the 10-bit fractional gains. The scalar 
+//  version defines the exact arithmetic; NEON and SSE2 must match it bit 
+//  for bit, so replaying training_data on a laptop tells the truth about 
+//  the Pi.
+#define FIXED_RADIUS 250
+
+static FixedConsts fixed_consts;
+static ClassifyParams fixed_params;
+static bool fixed_usable = false;
+
+//  with classifier_lock held; frames copy the constants
+static void build_fixed_consts() {
+    fixed_usable = false;
+    if (detect_ygain < 0 || detect_cgain < 0 || detect_d2 <= 0 || detect_ycenter + 20 <= 0) {
+        return;
+    }
+    float cy = sqrtf(detect_ygain / detect_d2) * FIXED_RADIUS;
+    float cc = sqrtf(detect_cgain / detect_d2) * FIXED_RADIUS;
+    float bu = detect_ucenter / (detect_ycenter + 20);
+    float bv = detect_vcenter / (detect_ycenter + 20);
+    //  keep all the intermediates inside 16 bits
+    if (cy >= 31.0f || cc >= 31.0f || fabsf(bu) >= 0.99f || fabsf(bv) >= 0.99f ||
+            detect_ycenter < 0 || detect_ycenter > 255) {
+        fprintf(stderr, "fixed-point classifier: settings out of range; using table\n");
+        return;
+    }
+    fixed_consts.yc = (short)lrintf(detect_ycenter * 64);
+    fixed_consts.cy = (short)lrintf(cy * 1024);
+    fixed_consts.cc = (short)lrintf(cc * 1024);
+    fixed_consts.bu = (short)lrintf(bu * 32768);
+    fixed_consts.bv = (short)lrintf(bv * 32768);
+    fixed_usable = true;
+}
+
+static inline int mulhi(int a, int b) {
+    return (a * b) >> 16;
+}
+
+static inline unsigned char classify_fixed(int y, int u, int v, FixedConsts const &fc) {
+    int sy = mulhi((y << 6) - fc.yc, fc.cy);
+    int yb = (y + 20) << 6;
+    int su = mulhi((u << 6) - (mulhi(yb, fc.bu) << 1), fc.cc);
+    int sv = mulhi((v << 6) - (mulhi(yb, fc.bv) << 1), fc.cc);
+    sy = std::min(abs(sy), 255);
+    su = std::min(abs(su), 255);
+    sv = std::min(abs(sv), 255);
+    unsigned int d = std::min(sy * sy + su * su, 65535);
+    d = std::min(d + sv * sv, 65535u);
+    return (d < FIXED_RADIUS * FIXED_RADIUS) ? 255 : 0;
+}
+
+static void classify_fixed_columns(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, int c, FixedConsts const &fc) {
+    for (; c < width; c += 2) {
+        int u0 = u[c >> 1] - 128;
+        int v0 = v[c >> 1] - 128;
+        dcls[c] = classify_fixed(y[c], u0, v0, fc);
+        dcls[c+1] = classify_fixed(y[c+1], u0, v0, fc);
+        dcls[width+c] = classify_fixed(y[width+c], u0, v0, fc);
+        dcls[width+c+1] = classify_fixed(y[width+c+1], u0, v0, fc);
+    }
+}
+
+//  pack 0/255 bytes from column c on into bits, and clear the row padding
+static void pack_mask_columns(unsigned char const *bytes, unsigned char *bits, int width, int c) {
+    int end = MASK_STRIDE(width) * 8;
+    for (; c < end; c += 8) {
+        unsigned char b = 0;
+        for (int i = 0; i != 8 && c + i < width; ++i) {
+            b |= (bytes[c + i] & 1) << i;
+        }
+        bits[c >> 3] = b;
+    }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#define DETECT_SIMD "neon"
+
+static inline int16x8_t mulhi_s16(int16x8_t a, int16x8_t b) {
+    int32x4_t lo = vmull_s16(vget_low_s16(a), vget_low_s16(b));
+    int32x4_t hi = vmull_s16(vget_high_s16(a), vget_high_s16(b));
+    return vcombine_s16(vshrn_n_s32(lo, 16), vshrn_n_s32(hi, 16));
+}
+
+static inline uint16x8_t classify_neon(int16x8_t y, int16x8_t u, int16x8_t v, FixedConsts const &fc) {
+    int16x8_t sy = mulhi_s16(vsubq_s16(vshlq_n_s16(y, 6), vdupq_n_s16(fc.yc)), vdupq_n_s16(fc.cy));
+    int16x8_t yb = vshlq_n_s16(vaddq_s16(y, vdupq_n_s16(20)), 6);
+    int16x8_t du = vsubq_s16(vshlq_n_s16(u, 6), vshlq_n_s16(mulhi_s16(yb, vdupq_n_s16(fc.bu)), 1));
+    int16x8_t dv = vsubq_s16(vshlq_n_s16(v, 6), vshlq_n_s16(mulhi_s16(yb, vdupq_n_s16(fc.bv)), 1));
+    int16x8_t su = mulhi_s16(du, vdupq_n_s16(fc.cc));
+    int16x8_t sv = mulhi_s16(dv, vdupq_n_s16(fc.cc));
+    int16x8_t lim = vdupq_n_s16(255);
+    uint16x8_t ay = vreinterpretq_u16_s16(vminq_s16(vabsq_s16(sy), lim));
+    uint16x8_t au = vreinterpretq_u16_s16(vminq_s16(vabsq_s16(su), lim));
+    uint16x8_t av = vreinterpretq_u16_s16(vminq_s16(vabsq_s16(sv), lim));
+    uint16x8_t d = vqaddq_u16(vqaddq_u16(vmulq_u16(ay, ay), vmulq_u16(au, au)), vmulq_u16(av, av));
+    return vcltq_u16(d, vdupq_n_u16(FIXED_RADIUS * FIXED_RADIUS));
+}
+
+static inline int16x8_t widen(uint8x8_t x) {
+    return vreinterpretq_s16_u16(vmovl_u8(x));
+}
+
+//  16 luma pixels on each of two rows, sharing 8 chroma samples
+static int classify_simd_block(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, FixedConsts const &fc) {
+    int16x8_t c128 = vdupq_n_s16(128);
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
+        uint8x8x2_t uu = vzip_u8(vld1_u8(u + (c >> 1)), vld1_u8(u + (c >> 1)));
+        uint8x8x2_t vv = vzip_u8(vld1_u8(v + (c >> 1)), vld1_u8(v + (c >> 1)));
+        int16x8_t ulo = vsubq_s16(widen(uu.val[0]), c128);
+        int16x8_t uhi = vsubq_s16(widen(uu.val[1]), c128);
+        int16x8_t vlo = vsubq_s16(widen(vv.val[0]), c128);
+        int16x8_t vhi = vsubq_s16(widen(vv.val[1]), c128);
+        for (int row = 0; row != 2; ++row) {
+            uint8x16_t yy = vld1q_u8(y + row * width + c);
+            uint16x8_t mlo = classify_neon(widen(vget_low_u8(yy)), ulo, vlo, fc);
+            uint16x8_t mhi = classify_neon(widen(vget_high_u8(yy)), uhi, vhi, fc);
+            vst1q_u8(dcls + row * width + c, vcombine_u8(vmovn_u16(mlo), vmovn_u16(mhi)));
+        }
+    }
+    return c;
+}
+
+//  one bit per byte of a 0/255 row, LSB first
+static void pack_mask_row(unsigned char const *bytes, unsigned char *bits, int width) {
+    static const unsigned char weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t w = vld1q_u8(weights);
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
+        uint8x16_t m = vandq_u8(vld1q_u8(bytes + c), w);
+        uint8x8_t p = vpadd_u8(vget_low_u8(m), vget_high_u8(m));
+        p = vpadd_u8(p, p);
+        p = vpadd_u8(p, p);
+        bits[c >> 3] = vget_lane_u8(p, 0);
+        bits[(c >> 3) + 1] = vget_lane_u8(p, 1);
+    }
+    pack_mask_columns(bytes, bits, width, c);
+}
+
+//  8 lanes at a time from already-widened samples
+static int classify_simd_lanes(short const *y, short const *u, short const *v, unsigned char *out, int n,
+        FixedConsts const &fc) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t m = classify_neon(vld1q_s16(y + i), vld1q_s16(u + i), vld1q_s16(v + i), fc);
+        vst1_u8(out + i, vmovn_u16(m));
+    }
+    return i;
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define DETECT_SIMD "sse2"
+
+static inline __m128i classify_sse2(__m128i y, __m128i u, __m128i v, FixedConsts const &fc) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sy = _mm_mulhi_epi16(_mm_sub_epi16(_mm_slli_epi16(y, 6), _mm_set1_epi16(fc.yc)), _mm_set1_epi16(fc.cy));
+    __m128i yb = _mm_slli_epi16(_mm_add_epi16(y, _mm_set1_epi16(20)), 6);
+    __m128i du = _mm_sub_epi16(_mm_slli_epi16(u, 6), _mm_slli_epi16(_mm_mulhi_epi16(yb, _mm_set1_epi16(fc.bu)), 1));
+    __m128i dv = _mm_sub_epi16(_mm_slli_epi16(v, 6), _mm_slli_epi16(_mm_mulhi_epi16(yb, _mm_set1_epi16(fc.bv)), 1));
+    __m128i su = _mm_mulhi_epi16(du, _mm_set1_epi16(fc.cc));
+    __m128i sv = _mm_mulhi_epi16(dv, _mm_set1_epi16(fc.cc));
+    __m128i lim = _mm_set1_epi16(255);
+    sy = _mm_min_epi16(_mm_max_epi16(sy, _mm_sub_epi16(zero, sy)), lim);
+    su = _mm_min_epi16(_mm_max_epi16(su, _mm_sub_epi16(zero, su)), lim);
+    sv = _mm_min_epi16(_mm_max_epi16(sv, _mm_sub_epi16(zero, sv)), lim);
+    __m128i d = _mm_adds_epu16(_mm_adds_epu16(_mm_mullo_epi16(sy, sy), _mm_mullo_epi16(su, su)), _mm_mullo_epi16(sv, sv));
+    //  no unsigned compare in SSE2: d < R*R  <=>  saturate(d - (R*R-1)) == 0
+    return _mm_cmpeq_epi16(_mm_subs_epu16(d, _mm_set1_epi16(FIXED_RADIUS * FIXED_RADIUS - 1)), zero);
+}
+
+//  16 luma pixels on each of two rows, sharing 8 chroma samples
+static int classify_simd_block(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, FixedConsts const &fc) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i c128 = _mm_set1_epi16(128);
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
+        __m128i uu = _mm_loadl_epi64((__m128i const *)(u + (c >> 1)));
+        __m128i vv = _mm_loadl_epi64((__m128i const *)(v + (c >> 1)));
+        uu = _mm_unpacklo_epi8(uu, uu);
+        vv = _mm_unpacklo_epi8(vv, vv);
+        __m128i ulo = _mm_sub_epi16(_mm_unpacklo_epi8(uu, zero), c128);
+        __m128i uhi = _mm_sub_epi16(_mm_unpackhi_epi8(uu, zero), c128);
+        __m128i vlo = _mm_sub_epi16(_mm_unpacklo_epi8(vv, zero), c128);
+        __m128i vhi = _mm_sub_epi16(_mm_unpackhi_epi8(vv, zero), c128);
+        for (int row = 0; row != 2; ++row) {
+            __m128i yy = _mm_loadu_si128((__m128i const *)(y + row * width + c));
+            __m128i mlo = classify_sse2(_mm_unpacklo_epi8(yy, zero), ulo, vlo, fc);
+            __m128i mhi = classify_sse2(_mm_unpackhi_epi8(yy, zero), uhi, vhi, fc);
+            _mm_storeu_si128((__m128i *)(dcls + row * width + c), _mm_packs_epi16(mlo, mhi));
+        }
+    }
+    return c;
+}
+
+//  one bit per byte of a 0/255 row, LSB first
+static void pack_mask_row(unsigned char const *bytes, unsigned char *bits, int width) {
+    int c = 0;
+    for (; c + 16 <= width; c += 16) {
+        int m = _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)(bytes + c)));
+        bits[c >> 3] = (unsigned char)m;
+        bits[(c >> 3) + 1] = (unsigned char)(m >> 8);
+    }
+    pack_mask_columns(bytes, bits, width, c);
+}
+
+//  8 lanes at a time from already-widened samples
+static int classify_simd_lanes(short const *y, short const *u, short const *v, unsigned char *out, int n,
+        FixedConsts const &fc) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i m = classify_sse2(_mm_loadu_si128((__m128i const *)(y + i)),
+                _mm_loadu_si128((__m128i const *)(u + i)), _mm_loadu_si128((__m128i const *)(v + i)), fc);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packs_epi16(m, m));
+    }
+    return i;
+}
+
+#else
+
+static int classify_simd_block(unsigned char const *, unsigned char const *, unsigned char const *,
+        unsigned char *, int, FixedConsts const &) {
+    return 0;
+}
+
+static void pack_mask_row(unsigned char const *bytes, unsigned char *bits, int width) {
+    pack_mask_columns(bytes, bits, width, 0);
+}
+
+static int classify_simd_lanes(short const *, short const *, short const *, unsigned char *, int,
+        FixedConsts const &) {
+    return 0;
+}
+
+#endif
+
+static bool prepare_fixed_consts(float const *now) {
+    if (classify_params_stale(fixed_params, now)) {
+        build_fixed_consts();
+        classify_params_set(fixed_params, now);
+    }
+    return fixed_usable;
+}
+
+static void classify_rows_fixed(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, Classifier const &cf) {
+    FixedConsts const fc = cf.fixed;
+    int c = classify_simd_block(y, u, v, dcls, width, fc);
+    classify_fixed_columns(y, u, v, dcls, width, c, fc);
+}
+
+//  Which classifier detect_color_inner() uses. Each one falls back to the 
+//  next slower one if the current settings don't fit its representation.
+//  The table matches the float reference exactly; the fixed-point kernel 
+//  rounds near the edge of the ellipsoid (a few pixels a frame,) so it 
+//  only runs when camcam.ini asks for detect_kernel=fixed.
+#if !defined(DETECT_SIMD)
+#define DETECT_SIMD "scalar"
+#endif
+static int detect_kernel = DETECT_KERNEL_TABLE;
+
+static char const *kernel_names[] = { "float", "table", "fixed" };
+
+int detect_set_kernel(char const *name) {
+    for (int i = 0; i != 3; ++i) {
+        if (!strcmp(name, kernel_names[i])) {
+            detect_kernel = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int detect_set_detector(char const *name) {
+    for (int i = 0; i != 2; ++i) {
+        if (!strcmp(name, detector_names[i])) {
+            steer_detector = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+char const *detect_detector_name() {
+    return detector_names[steer_detector];
+}
+
+int detect_get_kernel() {
+    return detect_kernel;
+}
+
+char const *detect_kernel_name(int kernel) {
+    if (kernel < 0 || kernel > 2) {
+        return "unknown";
+    }
+    return kernel_names[kernel];
+}
+
+static void classify_rows_float(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, Classifier const &) {
+    for (int c = 0; c < width; c += 2) {
+        float u0 = (float)*u - 128.0f;
+        float v0 = (float)*v - 128.0f;
+        dcls[0] = classify(y[0], u0, v0);
+        dcls[1] = classify(y[1], u0, v0);
+        dcls[width] = classify(y[width], u0, v0);
+        dcls[width+1] = classify(y[width+1], u0, v0);
+        dcls += 2;
+        y += 2;
+        u++;
+        v++;
+    }
+}
+
+//  Each kernel classifies two rows of luma sharing one row of chroma.
+typedef void (*ClassifyRows)(unsigned char const *y, unsigned char const *u, unsigned char const *v,
+        unsigned char *dcls, int width, Classifier const &cf);
+
+static ClassifyRows const classify_rows[3] = {
+    classify_rows_float,
+    classify_rows_table,
+    classify_rows_fixed
+};
+
+//  returns the kernel that can actually run with the current settings; 
+//  with classifier_lock held
+static int prepare_classifier(float const *now) {
+    switch (detect_kernel) {
+    case DETECT_KERNEL_FIXED:
+        if (prepare_fixed_consts(now)) {
+            return DETECT_KERNEL_FIXED;
+        }
+        //  fall through
+    case DETECT_KERNEL_TABLE:
+        if (prepare_classify_table(now)) {
+            return DETECT_KERNEL_TABLE;
+        }
+        //  fall through
+    default:
+        return DETECT_KERNEL_FLOAT;
+    }
+}
+
+//  Take what one frame classifies with: the settings are looked at once, 
+//  and the table (if any) stays put until release_classifier().
+static void acquire_classifier(Classifier &cf) {
+    float now[6] = { detect_ycenter, detect_ucenter, detect_vcenter, detect_ygain, detect_cgain, detect_d2 };
+    PLock lock(classifier_lock);
+    cf.kernel = prepare_classifier(now);
+    cf.table = NULL;
+    cf.tableIndex = -1;
+    if (cf.kernel == DETECT_KERNEL_TABLE) {
+        cf.tableIndex = classify_table_live;
+        cf.table = classify_tables[cf.tableIndex];
+        ++classify_table_users[cf.tableIndex];
+    } else if (cf.kernel == DETECT_KERNEL_FIXED) {
+        cf.fixed = fixed_consts;
+    }
+}
+
+static void release_classifier(Classifier &cf) {
+    if (cf.tableIndex >= 0) {
+        PLock lock(classifier_lock);
+        --classify_table_users[cf.tableIndex];
+        cf.tableIndex = -1;
+    }
+}
+
+//  Classify just the pixels a projection samples, one byte (0/255) each.
+//  The per-pixel versions of the kernels give the same answers as the 
+//  full-frame versions.
+static void classify_samples(ProjectSamples const *ps, unsigned char const *bptr, int width, int height,
+        unsigned char *out) {
+    unsigned char const *y = (unsigned char const *)bptr;
+    unsigned char const *u = (unsigned char const *)(y + width * height);
+    unsigned char const *v = (unsigned char const *)(u + width * height / 4);
+    int const *so = ps->srcOffset;
+    int const *co = ps->chromaOffset;
+    int n = ps->count;
+    Classifier cf;
+    acquire_classifier(cf);
+    switch (cf.kernel) {
+    case DETECT_KERNEL_FIXED: {
+            //  gather a batch into 16-bit lanes, then classify it with SIMD
+            FixedConsts const fc = cf.fixed;
+            short ys[64], us[64], vs[64];
+            for (int i = 0; i < n; i += 64) {
+                int m = std::min(64, n - i);
+                for (int j = 0; j != m; ++j) {
+                    ys[j] = y[so[i + j]];
+                    us[j] = u[co[i + j]] - 128;
+                    vs[j] = v[co[i + j]] - 128;
+                }
+                for (int j = classify_simd_lanes(ys, us, vs, out + i, m, fc); j != m; ++j) {
+                    out[i + j] = classify_fixed(ys[j], us[j], vs[j], fc);
+                }
+            }
+        }
+        break;
+    case DETECT_KERNEL_TABLE:
+        for (int i = 0; i != n; ++i) {
+            ClassifyRange cr = cf.table[(u[co[i]] << 8) | v[co[i]]];
+            out[i] = in_range(y[so[i]], cr.lo, cr.hi);
+        }
+        break;
+    default:
+        for (int i = 0; i != n; ++i) {
+            out[i] = classify(y[so[i]], (float)u[co[i]] - 128.0f, (float)v[co[i]] - 128.0f);
+        }
+        break;
+    }
+    release_classifier(cf);
+}
+
+//  Classify and project in one pass: the flat map comes straight from the 
+//  YUV source without a full-frame classification in between. mask gets 
+//  the 1bpp map, and bytes (if not NULL) the 0/255/MISSING_DATA version.
+static void detect_project_fused(ProjectSamples const *ps, unsigned char const *bptr, int width, int height,
+        unsigned char *scratch, unsigned char *mask, unsigned char *bytes) {
+    classify_samples(ps, bptr, width, height, scratch);
+    int stride = MASK_STRIDE(ps->width);
+    int const *cs = ps->cellSample;
+    memset(mask, 0, stride * ps->height);
+    for (int r = 0; r != ps->height; ++r) {
+        unsigned char *mrow = mask + r * stride;
+        for (int c = 0; c != ps->width; ++c) {
+            int ix = *cs++;
+            unsigned char val = (ix < 0) ? 0 : scratch[ix];
+            mrow[c >> 3] |= (val & 1) << (c & 7);
+            if (bytes) {
+                *bytes++ = (ix < 0) ? MISSING_DATA : val;
+            }
+        }
+    }
+}
+
+void detect_color_inner(unsigned char const *bptr, unsigned char *dcls, int width, int height) {
+    Classifier cf;
+    acquire_classifier(cf);
+    ClassifyRows fn = classify_rows[cf.kernel];
+    unsigned char const *y = (unsigned char const *)bptr;
+    unsigned char const *u = (unsigned char const *)(y + width * height);
+    unsigned char const *v = (unsigned char const *)(u + width * height / 4);
+    for (int r = 0; r < height; r += 2) {
+        fn(y, u, v, dcls, width, cf);
+        y += width * 2;
+        u += width / 2;
+        v += width / 2;
+        dcls += width * 2;
+    }
+    release_classifier(cf);
+}
+
+void detect_color_mask(unsigned char const *bptr, unsigned char *mask, int width, int height) {
+    //  two rows of bytes stays in L1, unlike a whole frame of them; on the 
+    //  stack rather than static, since several threads may classify at once
+    unsigned char line[PROC_WIDTH * 2];
+    if (width > PROC_WIDTH) {
+        fprintf(stderr, "detect_color_mask: width %d is more than %d\n", width, PROC_WIDTH);
+        return;
+    }
+    Classifier cf;
+    acquire_classifier(cf);
+    ClassifyRows fn = classify_rows[cf.kernel];
+    int stride = MASK_STRIDE(width);
+    unsigned char const *y = (unsigned char const *)bptr;
+    unsigned char const *u = (unsigned char const *)(y + width * height);
+    unsigned char const *v = (unsigned char const *)(u + width * height / 4);
+    for (int r = 0; r < height; r += 2) {
+        fn(y, u, v, line, width, cf);
+        pack_mask_row(line, mask, width);
+        pack_mask_row(line + width, mask + stride, width);
+        y += width * 2;
+        u += width / 2;
+        v += width / 2;
+        mask += stride * 2;
+    }
+    release_classifier(cf);
+}
+
 void read_analyzer_settings() {
     detect_ycenter = get_setting_float("detect_ycenter", detect_ycenter);
     detect_ucenter = get_setting_float("detect_ucenter", detect_ucenter);
@@ -390,6 +2535,62 @@ void read_analyzer_settings() {
     speed_gain = get_setting_float("speed_gain", speed_gain);
     turn_gain = get_setting_float("turn_gain", turn_gain);
     turn_squared_gain = get_setting_float("turn_squared_gain", turn_squared_gain);
+    project_k1 = get_setting_float("project_k1", project_k1);
+    project_k2 = get_setting_float("project_k2", project_k2);
+    project_p1 = get_setting_float("project_p1", project_p1);
+    project_p2 = get_setting_float("project_p2", project_p2);
+    project_row_growth = get_setting_float("project_row_growth", project_row_growth);
+    project_pitch_tracking = get_setting_int("project_pitch_tracking", project_pitch_tracking) != 0;
+    detect_track_steering = get_setting_int("detect_track_steering", detect_track_steering) != 0;
+    detect_robust_fit = get_setting_int("detect_robust_fit", detect_robust_fit) != 0;
+    project_occupancy_threshold = std::max(0, std::min(255, (int)get_setting_int("project_occupancy", project_occupancy_threshold)));
+    detect_set_label_threads(get_setting_int("detect_label_threads", label_threads));
+    pursuit_gain = get_setting_float("pursuit_gain", pursuit_gain);
+    pursuit_lookahead = get_setting_float("pursuit_lookahead", pursuit_lookahead);
+    pursuit_lookahead_speed = get_setting_float("pursuit_lookahead_speed", pursuit_lookahead_speed);
+    pursuit_wheelbase = get_setting_float("pursuit_wheelbase", pursuit_wheelbase);
+    pursuit_max_angle = std::max(0.01f, (float)get_setting_float("pursuit_max_angle", pursuit_max_angle));
+    ground_map_enabled = get_setting_int("ground_map", ground_map_enabled) != 0;
+    odometry_per_tick = get_setting_float("odometry_per_tick", odometry_per_tick);
+    odometry_track = get_setting_float("odometry_track", odometry_track);
+    char const *detector = get_setting("steer_detector", NULL);
+    if (detector && detect_set_detector(detector) < 0) {
+        fprintf(stderr, "steer_detector=%s is not known; using %s\n", detector, detector_names[steer_detector]);
+    }
+    char const *mode = get_setting("steer_mode", NULL);
+    if (mode) {
+        if (!strcmp(mode, steer_mode_names[STEER_LINE])) {
+            steer_mode = STEER_LINE;
+        } else if (!strcmp(mode, steer_mode_names[STEER_PURSUIT])) {
+            steer_mode = STEER_PURSUIT;
+        } else {
+            fprintf(stderr, "steer_mode=%s is not known; using %s\n", mode, steer_mode_names[steer_mode]);
+        }
+    }
+    char const *morph = get_setting("detect_morphology", NULL);
+    if (morph) {
+        int i = 0;
+        while (i != 4 && strcmp(morph, morphology_names[i])) {
+            ++i;
+        }
+        if (i == 4) {
+            fprintf(stderr, "detect_morphology=%s is not known; using %s\n", morph, morphology_names[detect_morphology]);
+        } else {
+            detect_morphology = i;
+        }
+    }
+    char const *kernel = get_setting("detect_kernel", NULL);
+    if (kernel && detect_set_kernel(kernel) < 0) {
+        fprintf(stderr, "detect_kernel=%s is not known; using %s\n", kernel, detect_kernel_name(detect_kernel));
+    }
+    fprintf(stderr, "analyzer_settings: kernel=%s simd=%s k1=%g k2=%g p1=%g p2=%g occupancy=%d row_growth=%g pitch_tracking=%d label_threads=%d track_steering=%d morphology=%s robust_fit=%d\n", detect_kernel_name(detect_kernel), DETECT_SIMD,
+            project_k1, project_k2, project_p1, project_p2, project_occupancy_threshold, project_row_growth, project_pitch_tracking, label_threads,
+            detect_track_steering, morphology_names[detect_morphology], detect_robust_fit);
+    fprintf(stderr, "analyzer_settings: steer_detector=%s steer_mode=%s pursuit_gain=%.2f pursuit_lookahead=%.1f pursuit_lookahead_speed=%.1f pursuit_wheelbase=%.1f pursuit_max_angle=%.2f\n",
+            detector_names[steer_detector], steer_mode_names[steer_mode], pursuit_gain, pursuit_lookahead, pursuit_lookahead_speed,
+            pursuit_wheelbase, pursuit_max_angle);
+    fprintf(stderr, "analyzer_settings: ground_map=%d odometry_per_tick=%g odometry_track=%g\n",
+            ground_map_enabled, odometry_per_tick, odometry_track);
     fprintf(stderr,
             "analyzer_settings: speed_gain=%.2f turn_gain=%.2f turn_squared_gain=%.2f ycenter=%.2f ucenter=%.2f vcenter=%.2f ygain=%.2f cgain=%.2f d2=%.0f\n",
             speed_gain, turn_gain, turn_squared_gain, detect_ycenter, detect_ucenter, detect_vcenter, detect_ygain, detect_cgain, detect_d2);
@@ -16,6 +16,11 @@
 #define PROJECT_WIDTH 128
 #define PROJECT_HEIGHT 128
 
+#define PROJECT_RESOLUTION 0.67f
+#define CAMERA_HEIGHT 25.0f
+#define CAMERA_WIDTH_RADIANS (60.0f * 3.1415927f / 180.0f)
+#define ANGLED_DOWN_RADIANS (25.0f * 3.1415927f / 180.0f)
+
 extern float detect_ygain;
 extern float detect_cgain;
 extern float detect_d2;
@@ -31,19 +36,142 @@ struct Cluster {
     int miny;
     int maxy;
     int count;
-    unsigned char label;
+    float weight;       /* count, or the sum of occupancy / 255 */
+    /* on the ground (see project_cell_ground()), since map rows need not 
+     * be evenly spaced: the middle across, and the near and far edges.
+     */
+    float groundX;
+    float groundNear;
+    float groundFar;
+    /* cell moments in flat map cells, gathered while labeling: the 
+     * centroid, and the covariance of the cells around it, which gives 
+     * the orientation and elongation (see cluster_axis().)
+     */
+    float cx;
+    float cy;
+    float cxx;
+    float cxy;
+    float cyy;
+    unsigned short label;
+};
+/* a horizontal run of set cells x0..x1 in one row of the flat map, and 
+ * the label of the Cluster it belongs to (0 if none) */
+struct ClusterRun {
+    short row;
+    short x0;
+    short x1;
+    unsigned short label;
+};
+/* a cluster followed from frame to frame, at its centroid on the ground 
+ * (in the units of Cluster::groundX) */
+struct ClusterTrack {
+    int id;             /* the same for as long as the track lives */
+    int age;            /* frames a cluster was matched to it */
+    int missed;         /* frames since the last match */
+    int cluster;        /* index into DetectOutput::clusters, or -1 */
+    float x;            /* smoothed position */
+    float y;
+    float vx;           /* per frame */
+    float vy;
+};
+/* a straight line the Hough detector found: X = a + b Y in flat map cells, 
+ * with rows evenly spaced at the near resolution */
+struct DetectLine {
+    float a;
+    float b;
+    int votes;
 };
 struct DetectOutput {
     float steer;
     float drive;
     int num_clusters;
     Cluster const *clusters;
+    int num_runs;
+    ClusterRun const *runs;     /* in row order, left to right */
+    /* Tracks of the clusters; set detect_track_steering in camcam.ini to 
+     * steer only by clusters whose tracks have lasted a couple of frames.
+     */
+    int num_tracks;
+    ClusterTrack const *tracks;
+    /* How well the steering line fits: the points it was fit to (clusters, 
+     * or runs with detect_robust_fit in camcam.ini), how many of them lie 
+     * on it, and their RMS distance from it in map cells. 0 when steering 
+     * didn't fit a line.
+     */
+    int fit_points;
+    int fit_inliers;
+    float fit_residual;
+    /* with steer_detector=hough, the lines steering went by */
+    int num_lines;
+    DetectLine const *lines;
 };
 DETECTINNER_EXPORT int determine_steering(unsigned char const *analyze_output, int width, int height, struct Frame *frame, DetectOutput *out);
+/* format is FRAME_FORMAT_GRAY (0/255 bytes), FRAME_FORMAT_MASK (see mask.h), 
+ * or FRAME_FORMAT_YUV420, which classifies only the pixels the projection 
+ * samples, straight into the flat map.
+ */
+DETECTINNER_EXPORT int determine_steering_format(unsigned char const *analyze_output, int format, int width, int height, struct Frame *frame, DetectOutput *out);
+/* set project_occupancy in camcam.ini to 1..255 to cluster on supersampled 
+ * occupancy (see project_occupancy()) instead of the single nearest sample; 
+ * a cell counts as set when its occupancy is at least that value.
+ */
+DETECTINNER_EXPORT int detect_clusters_occupancy(unsigned char threshold, unsigned char const *input, int width, int height,
+        ClusterRun *runs, int run_count, int *out_runs, Cluster *output, int output_count, int min_size, int *out_errors);
+/* the camera pitch the projection plan is aimed at; it follows the 
+ * picture when project_pitch_tracking is set in camcam.ini
+ */
+DETECTINNER_EXPORT float detect_get_pitch();
+/* how many cores label clusters, in horizontal bands of the flat map 
+ * (detect_label_threads in camcam.ini, 1 to 4.) The clusters, runs and 
+ * labels are the same for any count. Returns the count now in use.
+ */
+DETECTINNER_EXPORT int detect_set_label_threads(int threads);
+/* With ground_map=1 in camcam.ini, a map of the ground around the rover is 
+ * kept from frame to frame, moved along by the wheel encoder counts 
+ * (T2H_State::m1 and m2, left and right; see odometry_per_tick and 
+ * odometry_track), so lines that have gone under or beside the camera 
+ * are still known. Pass the latest counts before determine_steering_format().
+ */
+DETECTINNER_EXPORT int detect_set_ground_map(int enabled);
+DETECTINNER_EXPORT void detect_set_odometry(unsigned int m1, unsigned int m2);
+/* how often the ground at x (right) and y (ahead of the camera) was seen 
+ * set lately, 0 to 1 */
+DETECTINNER_EXPORT float detect_ground_map_at(float gx, float gy);
+/* the map around the rover, heading up, one byte per PROJECT_RESOLUTION */
+DETECTINNER_EXPORT void detect_ground_map_view(unsigned char *dst, int width, int height);
+/* the colour ground view of an I420 frame, PROJECT_WIDTH x PROJECT_HEIGHT 
+ * x 3 bytes of PROJECT_PACKED_RGB or _YUV (see project_i420().) Uses the 
+ * plan determine_steering_format() last built, so call it after that; 
+ * returns -1 if there is no plan for this frame size.
+ */
+DETECTINNER_EXPORT int detect_project_color(unsigned char const *yuv, int width, int height, unsigned char *dst, int format);
 DETECTINNER_EXPORT void detect_color_inner(unsigned char const *bptr, unsigned char *dcls, int width, int height);
+/* the same, but writes a 1bpp mask of MASK_SIZE(width, height) bytes */
+DETECTINNER_EXPORT void detect_color_mask(unsigned char const *bptr, unsigned char *mask, int width, int height);
+/* the float classifier that detect_color_inner() must match, for verification */
+DETECTINNER_EXPORT void detect_color_reference(unsigned char const *bptr, unsigned char *dcls, int width, int height);
+/* select the classifier used by detect_color_inner(): "float", "table", or 
+ * "fixed" (16-bit fixed point, NEON or SSE2 when compiled in.) Returns the 
+ * DETECT_KERNEL_ value, or -1 if the name is not known.
+ */
+#define DETECT_KERNEL_FLOAT 0
+#define DETECT_KERNEL_TABLE 1
+#define DETECT_KERNEL_FIXED 2
+DETECTINNER_EXPORT int detect_set_kernel(char const *name);
+/* select what steering looks for: "clusters" or "hough" lines; returns 
+ * -1 if the name is not known */
+DETECTINNER_EXPORT int detect_set_detector(char const *name);
+DETECTINNER_EXPORT char const *detect_detector_name();
+DETECTINNER_EXPORT int detect_get_kernel();
+DETECTINNER_EXPORT char const *detect_kernel_name(int kernel);
 DETECTINNER_EXPORT void read_analyzer_settings();
 DETECTINNER_EXPORT unsigned char *get_sqproj(int *ow, int *oh);
 DETECTINNER_EXPORT unsigned char *get_sqproj_work(int *ow, int *oh);
+/* the principal axis of a cluster from its moments: the variance of its 
+ * cells along (major) and across (minor) it, and a unit vector along it 
+ * in map cells. Returns non-zero if the cluster is clearly elongated.
+ */
+DETECTINNER_EXPORT int cluster_axis(Cluster const *cl, float *major, float *minor, float *ax, float *ay);
 DETECTINNER_EXPORT int paint_clusters(unsigned char *buf, int w, int h, Cluster const *cl, int ncl);
 
 struct Gains {
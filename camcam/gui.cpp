@@ -473,6 +473,7 @@ void ColorPickerWidget::movement(bool inside, float fx, float fy) {
 GLuint atex;
 GLuint ctex;
 GLuint stex;        //  square texture
+GLuint gtex;        //  colour ground view
 bool porterror = false;
 bool drawDetect = false;
 
@@ -514,6 +515,20 @@ void drawTheQuad() {
     assert(!glGetError());
 }
 
+//  the flat map and colour ground view, to the right of the camera picture
+void drawGroundQuad() {
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 1);
+    glVertex2f(0.45f, -0.25f*8/5);
+    glTexCoord2f(1, 1);
+    glVertex2f(0.95f, -0.25f*8/5);
+    glTexCoord2f(1, 0);
+    glVertex2f(0.95f, 0.25f*8/5);
+    glTexCoord2f(0, 0);
+    glVertex2f(0.45f, 0.25f*8/5);
+    glEnd();
+}
+
 
 void drawText(char const *text, float x, float y, float r, float g, float b, float a) {
     glColor4f(r, g, b, a);
@@ -785,6 +800,13 @@ void display() {
                 GL_LUMINANCE, GL_UNSIGNED_BYTE, sqframe->data_);
         assert(!glGetError());
     }
+    Frame *groundframe = sqframe ? sqframe->link_ : NULL;
+    if (groundframe) {
+        glBindTexture(GL_TEXTURE_2D, gtex);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, groundframe->width_, groundframe->height_,
+                GL_RGB, GL_UNSIGNED_BYTE, groundframe->data_);
+        assert(!glGetError());
+    }
     if (debugDump && yuvframe && dirtyFrame && sqframe) {
         fprintf(stderr, "debugDump: /tmp/debug-analyzed.png\n");
         stbi_write_png("/tmp/debug-analyzed.png", PROC_WIDTH, PROC_HEIGHT, 1, dirtyFrame->data_, 0);
@@ -793,6 +815,10 @@ void display() {
         detect_get_last_output(&output);
         paint_clusters(sqframe->data_, sqframe->width_, sqframe->height_, output.clusters, output.num_clusters);
         stbi_write_png("/tmp/debug-square.png", sqframe->width_, sqframe->height_, 1, sqframe->data_, 0);
+        if (groundframe) {
+            fprintf(stderr, "debugDump: /tmp/debug-ground.png\n");
+            stbi_write_png("/tmp/debug-ground.png", groundframe->width_, groundframe->height_, 3, groundframe->data_, 0);
+        }
         fprintf(stderr, "debugDump: /tmp/debug-yuv.yuv\n");
         FILE *f = fopen("/tmp/debug-yuv.yuv", "wb");
         fwrite(yuvframe->data_, 1, PROC_WIDTH * PROC_HEIGHT * 6/4, f);
@@ -829,22 +855,17 @@ void display() {
     }
 
     if (drawDetect) {
+        //  the colour ground view, with the flat map tinted over it
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+        glBindTexture(GL_TEXTURE_2D, gtex);
+        glEnable(GL_TEXTURE_2D);
+        drawGroundQuad();
         glEnable(GL_BLEND);
         glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
         glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
         glColor4f(0.0f, 1.0f, 1.0f, 0.25f);
         glBindTexture(GL_TEXTURE_2D, stex);
-        glEnable(GL_TEXTURE_2D);
-        glBegin(GL_QUADS);
-        glTexCoord2f(0, 1);
-        glVertex2f(0.45f, -0.25f*8/5);
-        glTexCoord2f(1, 1);
-        glVertex2f(0.95f, -0.25f*8/5);
-        glTexCoord2f(1, 0);
-        glVertex2f(0.95f, 0.25f*8/5);
-        glTexCoord2f(0, 0);
-        glVertex2f(0.45f, 0.25f*8/5);
-        glEnd();
+        drawGroundQuad();
         glDisable(GL_BLEND);
         assert(!glGetError());
     }
@@ -1069,6 +1090,7 @@ void create_main_window() {
     atex = mktex(GL_LUMINANCE, 512);
     ctex = mktex(GL_RGB, 512);
     stex = mktex(GL_LUMINANCE, 128);
+    gtex = mktex(GL_RGB, 128);
 }
 
 void run_main_loop() {
@@ -0,0 +1,94 @@
+#if !defined(mask_h)
+#define mask_h
+
+/* 1 bit per pixel masks (Frame format 5.) Pixel x of a row is bit (x & 7)
+ * of byte (x >> 3), so on a little-endian CPU it is also bit (x & 63) of
+ * 64-bit word (x >> 6). Rows are padded to a whole number of 64-bit words,
+ * and the padding bits are always 0.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define MASK_STRIDE(width) ((((width) + 63) >> 6) << 3)
+#define MASK_SIZE(width, height) (MASK_STRIDE(width) * (height))
+
+static inline int mask_get(unsigned char const *mask, int stride, int x, int y) {
+    return (mask[y * stride + (x >> 3)] >> (x & 7)) & 1;
+}
+
+/* expand a mask to one byte per pixel, 0 or 255, for display */
+static inline void mask_to_bytes(unsigned char const *mask, unsigned char *bytes, int width, int height) {
+    int stride = MASK_STRIDE(width);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            *bytes++ = (unsigned char)(0 - ((mask[x >> 3] >> (x & 7)) & 1));
+        }
+        mask += stride;
+    }
+}
+
+/* 3x3 erosion (dilate = 0) or dilation (dilate = 1) of a mask, a 64-bit 
+ * word at a time: shifts bring in the left and right neighbors, and the 
+ * rows above and below are combined whole. Cells past the edges count as 
+ * whatever leaves the edge cells alone. tmp is MASK_SIZE(width, height) 
+ * bytes; dst may be src.
+ */
+static inline void mask_morph_3x3(unsigned char const *src, unsigned char *dst, unsigned char *tmp, int width, int height, int dilate) {
+    int stride = MASK_STRIDE(width);
+    int words = stride >> 3;
+    uint64_t const edge = dilate ? 0 : ~(uint64_t)0;
+    uint64_t const pad = (width & 63) ? ~(uint64_t)0 << (width & 63) : 0;
+    for (int y = 0; y < height; ++y) {
+        unsigned char const *s = src + y * stride;
+        uint64_t prev = edge, cur, next;
+        memcpy(&cur, s, 8);
+        for (int i = 0; i < words; ++i) {
+            if (i + 1 < words) {
+                memcpy(&next, s + (i + 1) * 8, 8);
+            } else {
+                next = edge;
+                if (!dilate) {
+                    cur |= pad;
+                }
+            }
+            uint64_t left = (cur << 1) | (prev >> 63);
+            uint64_t right = (cur >> 1) | (next << 63);
+            uint64_t out = dilate ? (cur | left | right) : (cur & left & right);
+            memcpy(tmp + y * stride + i * 8, &out, 8);
+            prev = cur;
+            cur = next;
+        }
+    }
+    for (int i = 0; i < words; ++i) {
+        uint64_t keep = (i + 1 < words) ? ~(uint64_t)0 : ~pad;
+        uint64_t up = edge, cur, down;
+        memcpy(&cur, tmp + i * 8, 8);
+        for (int y = 0; y < height; ++y) {
+            if (y + 1 < height) {
+                memcpy(&down, tmp + (y + 1) * stride + i * 8, 8);
+            } else {
+                down = edge;
+            }
+            uint64_t out = (dilate ? (up | cur | down) : (up & cur & down)) & keep;
+            memcpy(dst + y * stride + i * 8, &out, 8);
+            up = cur;
+            cur = down;
+        }
+    }
+}
+
+/* Opening (erode, then dilate) removes specks and spurs thinner than 3 
+ * cells; closing (dilate, then erode) fills pinholes and gaps that narrow.
+ */
+static inline void mask_open(unsigned char const *src, unsigned char *dst, unsigned char *tmp, int width, int height) {
+    mask_morph_3x3(src, dst, tmp, width, height, 0);
+    mask_morph_3x3(dst, dst, tmp, width, height, 1);
+}
+
+static inline void mask_close(unsigned char const *src, unsigned char *dst, unsigned char *tmp, int width, int height) {
+    mask_morph_3x3(src, dst, tmp, width, height, 1);
+    mask_morph_3x3(dst, dst, tmp, width, height, 0);
+}
+
+#endif  //  mask_h
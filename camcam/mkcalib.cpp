@@ -0,0 +1,324 @@
+#include "detect_inner.h"
+#include "project.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+/* Estimate radial lens distortion (project_k1, project_k2) from pictures of
+ * a checkerboard. The board corners are found in each frame, chained into
+ * rows and columns, and k1/k2 are picked so the undistorted rows and
+ * columns are as straight as possible ("plumb line" calibration.) The
+ * tangential terms are left alone; for a camera module with a glued-in
+ * lens they are small compared to the radial ones.
+ */
+
+#define WIDTH 320
+#define HEIGHT 240
+#define BOX 4           //  half size of the corner detector window
+#define NMS 5           //  non-max suppression radius
+#define MIN_LINE 4      //  corners in a row before it's used for fitting
+
+struct Corner {
+    float x;
+    float y;
+    float score;
+    int right;
+    int down;
+    bool hasLeft;
+    bool hasUp;
+};
+
+struct Line {
+    std::vector<float> x;
+    std::vector<float> y;
+};
+
+static unsigned int integral[(WIDTH+1)*(HEIGHT+1)];
+static float scores[WIDTH*HEIGHT];
+
+static unsigned int box_sum(int l, int t, int r, int b) {
+    return integral[b*(WIDTH+1)+r] - integral[t*(WIDTH+1)+r] - integral[b*(WIDTH+1)+l] + integral[t*(WIDTH+1)+l];
+}
+
+//  An X-junction has two bright quadrants diagonal from each other, and
+//  two dark ones. Score is high only when the diagonals match each other
+//  and differ from the off-diagonals.
+static float corner_score(int x, int y) {
+    float a = (float)box_sum(x-BOX, y-BOX, x, y);
+    float b = (float)box_sum(x, y-BOX, x+BOX, y);
+    float c = (float)box_sum(x-BOX, y, x, y+BOX);
+    float d = (float)box_sum(x, y, x+BOX, y+BOX);
+    return fabsf((a + d) - (b + c)) - fabsf(a - d) - fabsf(b - c);
+}
+
+//  sub-pixel offset of the peak of a parabola through three samples
+static float parabola_peak(float l, float m, float r) {
+    float den = l - 2.0f * m + r;
+    if (den >= 0) {
+        return 0;
+    }
+    return 0.5f * (l - r) / den;
+}
+
+static void find_corners(unsigned char const *y, std::vector<Corner> &out) {
+    memset(integral, 0, sizeof(integral));
+    for (int r = 0; r < HEIGHT; ++r) {
+        unsigned int row = 0;
+        for (int c = 0; c < WIDTH; ++c) {
+            row += y[r*WIDTH+c];
+            integral[(r+1)*(WIDTH+1)+c+1] = integral[r*(WIDTH+1)+c+1] + row;
+        }
+    }
+    float best = 0;
+    memset(scores, 0, sizeof(scores));
+    for (int r = BOX; r < HEIGHT-BOX; ++r) {
+        for (int c = BOX; c < WIDTH-BOX; ++c) {
+            float s = corner_score(c, r);
+            scores[r*WIDTH+c] = s;
+            if (s > best) {
+                best = s;
+            }
+        }
+    }
+    float threshold = best * 0.3f;
+    for (int r = BOX+1; r < HEIGHT-BOX; ++r) {
+        for (int c = BOX+1; c < WIDTH-BOX; ++c) {
+            float s = scores[r*WIDTH+c];
+            if (s < threshold) {
+                continue;
+            }
+            bool peak = true;
+            for (int dy = -NMS; dy <= NMS && peak; ++dy) {
+                for (int dx = -NMS; dx <= NMS; ++dx) {
+                    int yy = r + dy, xx = c + dx;
+                    if (yy < 0 || yy >= HEIGHT || xx < 0 || xx >= WIDTH) {
+                        continue;
+                    }
+                    float o = scores[yy*WIDTH+xx];
+                    //  break ties towards the top left
+                    if (o > s || (o == s && (dy < 0 || (dy == 0 && dx < 0)))) {
+                        peak = false;
+                        break;
+                    }
+                }
+            }
+            if (!peak) {
+                continue;
+            }
+            Corner k;
+            //  score (c, r) puts the junction on the pixel boundary, which
+            //  is coordinate c in a system where pixel c spans [c, c+1)
+            k.x = c + parabola_peak(scores[r*WIDTH+c-1], s, scores[r*WIDTH+c+1]);
+            k.y = r + parabola_peak(scores[(r-1)*WIDTH+c], s, scores[(r+1)*WIDTH+c]);
+            k.score = s;
+            k.right = -1;
+            k.down = -1;
+            k.hasLeft = false;
+            k.hasUp = false;
+            out.push_back(k);
+        }
+    }
+}
+
+//  The nearest corner that is mostly to the right (or below) is the next
+//  one in the row (column.) Distortion bends lines, but not by anything
+//  near 30 degrees between neighbors.
+static void link_corners(std::vector<Corner> &corners) {
+    for (size_t i = 0; i != corners.size(); ++i) {
+        float bestRight = 1e9f, bestDown = 1e9f;
+        for (size_t j = 0; j != corners.size(); ++j) {
+            float dx = corners[j].x - corners[i].x;
+            float dy = corners[j].y - corners[i].y;
+            float d2 = dx * dx + dy * dy;
+            if (dx > 0 && fabsf(dy) < dx * 0.5f && d2 < bestRight) {
+                bestRight = d2;
+                corners[i].right = (int)j;
+            }
+            if (dy > 0 && fabsf(dx) < dy * 0.5f && d2 < bestDown) {
+                bestDown = d2;
+                corners[i].down = (int)j;
+            }
+        }
+    }
+    for (size_t i = 0; i != corners.size(); ++i) {
+        if (corners[i].right >= 0) {
+            corners[corners[i].right].hasLeft = true;
+        }
+        if (corners[i].down >= 0) {
+            corners[corners[i].down].hasUp = true;
+        }
+    }
+}
+
+//  Past the first step, each next corner is looked for where the last
+//  step predicts it, so strongly curved rows near the edge of the picture
+//  don't jump to the neighboring row.
+static int predicted_corner(std::vector<Corner> const &corners, float px, float py, float step2) {
+    int best = -1;
+    float bestD2 = step2 * 0.09f;
+    for (size_t j = 0; j != corners.size(); ++j) {
+        float dx = corners[j].x - px;
+        float dy = corners[j].y - py;
+        float d2 = dx * dx + dy * dy;
+        if (d2 < bestD2) {
+            bestD2 = d2;
+            best = (int)j;
+        }
+    }
+    return best;
+}
+
+static void chain_lines(std::vector<Corner> const &corners, std::vector<Line> &lines) {
+    std::vector<bool> used[2];
+    used[0].resize(corners.size());
+    used[1].resize(corners.size());
+    for (size_t i = 0; i != corners.size(); ++i) {
+        for (int dir = 0; dir != 2; ++dir) {
+            if (dir == 0 ? corners[i].hasLeft : corners[i].hasUp) {
+                continue;
+            }
+            Line l;
+            int n = (int)i;
+            int next = (dir == 0) ? corners[n].right : corners[n].down;
+            while (n >= 0 && !used[dir][n]) {
+                used[dir][n] = true;
+                l.x.push_back(corners[n].x);
+                l.y.push_back(corners[n].y);
+                if (next < 0) {
+                    break;
+                }
+                float sx = corners[next].x - corners[n].x;
+                float sy = corners[next].y - corners[n].y;
+                n = next;
+                next = predicted_corner(corners, corners[n].x + sx, corners[n].y + sy, sx * sx + sy * sy);
+            }
+            if (l.x.size() >= MIN_LINE) {
+                lines.push_back(l);
+            }
+        }
+    }
+}
+
+//  Sum over lines of (squared distance from the best-fit line) / (squared
+//  spread along it), so the answer doesn't improve by just shrinking the
+//  picture.
+static double straightness(std::vector<Line> const &lines, ProjectParameters const &params) {
+    double total = 0;
+    for (size_t i = 0; i != lines.size(); ++i) {
+        Line const &l = lines[i];
+        size_t n = l.x.size();
+        double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+        for (size_t j = 0; j != n; ++j) {
+            float ux, uy;
+            project_undistort(&params, l.x[j], l.y[j], &ux, &uy);
+            sx += ux;
+            sy += uy;
+            sxx += (double)ux * ux;
+            syy += (double)uy * uy;
+            sxy += (double)ux * uy;
+        }
+        double cxx = sxx / n - (sx / n) * (sx / n);
+        double cyy = syy / n - (sy / n) * (sy / n);
+        double cxy = sxy / n - (sx / n) * (sy / n);
+        double mid = (cxx + cyy) * 0.5;
+        double dif = sqrt((cxx - cyy) * (cxx - cyy) * 0.25 + cxy * cxy);
+        double major = mid + dif;
+        if (major > 0) {
+            total += (mid - dif) / major;
+        }
+    }
+    return total;
+}
+
+static double cost_at(std::vector<Line> const &lines, ProjectParameters &params, float *k, float v) {
+    float old = *k;
+    *k = v;
+    double ret = straightness(lines, params);
+    *k = old;
+    return ret;
+}
+
+static float golden_section(std::vector<Line> const &lines, ProjectParameters &params, float *k, float lo, float hi) {
+    float const g = 0.6180340f;
+    float a = hi - (hi - lo) * g;
+    float b = lo + (hi - lo) * g;
+    double fa = cost_at(lines, params, k, a);
+    double fb = cost_at(lines, params, k, b);
+    for (int i = 0; i != 40; ++i) {
+        if (fa < fb) {
+            hi = b;
+            b = a;
+            fb = fa;
+            a = hi - (hi - lo) * g;
+            fa = cost_at(lines, params, k, a);
+        } else {
+            lo = a;
+            a = b;
+            fa = fb;
+            b = lo + (hi - lo) * g;
+            fb = cost_at(lines, params, k, b);
+        }
+    }
+    return (lo + hi) * 0.5f;
+}
+
+static unsigned char *load_yuv(char const *name) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        perror(name);
+        return NULL;
+    }
+    unsigned char *buf = (unsigned char *)malloc(WIDTH*HEIGHT);
+    if (WIDTH*HEIGHT != fread(buf, 1, WIDTH*HEIGHT, f)) {
+        fprintf(stderr, "%s: expected a %dx%d YUV420 file\n", name, WIDTH, HEIGHT);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: mkcalib board.yuv ...\n");
+        fprintf(stderr, "prints project_k1 and project_k2 settings for camcam.ini\n");
+        return 1;
+    }
+    std::vector<Line> lines;
+    for (int i = 1; i != argc; ++i) {
+        unsigned char *y = load_yuv(argv[i]);
+        if (!y) {
+            return 2;
+        }
+        std::vector<Corner> corners;
+        find_corners(y, corners);
+        link_corners(corners);
+        size_t before = lines.size();
+        chain_lines(corners, lines);
+        fprintf(stderr, "%s: %d corners, %d lines\n", argv[i], (int)corners.size(), (int)(lines.size() - before));
+        free(y);
+    }
+    if (lines.size() < 2) {
+        fprintf(stderr, "not enough board lines found to calibrate\n");
+        return 2;
+    }
+
+    ProjectParameters params = { 0 };
+    params.widthRadians = CAMERA_WIDTH_RADIANS;
+    params.inWidth = WIDTH;
+    params.inHeight = HEIGHT;
+    double before = straightness(lines, params);
+    //  coordinate descent; k1 dominates, so it goes first and last
+    for (int round = 0; round != 4; ++round) {
+        params.k1 = golden_section(lines, params, &params.k1, -0.6f, 0.6f);
+        params.k2 = golden_section(lines, params, &params.k2, -0.6f, 0.6f);
+    }
+    params.k1 = golden_section(lines, params, &params.k1, -0.6f, 0.6f);
+    double after = straightness(lines, params);
+    fprintf(stderr, "%d lines, residual %g -> %g\n", (int)lines.size(), before, after);
+    printf("project_k1=%.5f\n", params.k1);
+    printf("project_k2=%.5f\n", params.k2);
+    return 0;
+}
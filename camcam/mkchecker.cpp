@@ -1,13 +1,19 @@
+#include "detect_inner.h"
+#include "project.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 unsigned char Y[320*240];
 unsigned char u[160*120];
 unsigned char v[160*120];
 
 #define COLORGAIN 0.25f
+#define BOARD_SQUARE 20
 
-int main() {
+//  random blocks of "yellow" for testing the detector
+void make_blocks() {
     for (int y = 0; y < 15; ++y) {
         for (int x = 0; x < 20; ++x) {
             unsigned char yy = (unsigned char)((rand() & 0x7f) + 64);
@@ -35,6 +41,46 @@ int main() {
             }
         }
     }
+}
+
+//  a gray checkerboard, as seen through a lens with the given distortion,
+//  for testing mkcalib
+void make_board(float k1, float k2) {
+    ProjectParameters params = { 0 };
+    params.widthRadians = CAMERA_WIDTH_RADIANS;
+    params.inWidth = 320;
+    params.inHeight = 240;
+    params.k1 = k1;
+    params.k2 = k2;
+    for (int y = 0; y < 240; ++y) {
+        for (int x = 0; x < 320; ++x) {
+            //  4x4 supersampled, so corners land between pixels
+            int sum = 0;
+            for (int sy = 0; sy != 4; ++sy) {
+                for (int sx = 0; sx != 4; ++sx) {
+                    float ux, uy;
+                    project_undistort(&params, x + (sx + 0.5f) * 0.25f, y + (sy + 0.5f) * 0.25f, &ux, &uy);
+                    int cx = (int)floorf((ux - 160) / BOARD_SQUARE);
+                    int cy = (int)floorf((uy - 120) / BOARD_SQUARE);
+                    sum += ((cx + cy) & 1) ? 40 : 200;
+                }
+            }
+            Y[y*320 + x] = (unsigned char)(sum / 16);
+        }
+    }
+    memset(u, 128, sizeof(u));
+    memset(v, 128, sizeof(v));
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "board")) {
+        make_board(argc > 2 ? atof(argv[2]) : 0.0f, argc > 3 ? atof(argv[3]) : 0.0f);
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: mkchecker [board [k1 [k2]]] > output.yuv\n");
+        return 1;
+    } else {
+        make_blocks();
+    }
     if (320*240 != fwrite(Y, 1, 320*240, stdout)) {
         fprintf(stderr, "Y: short write\n");
         return 1;
@@ -49,4 +95,3 @@ int main() {
     }
     return 0;
 }
-
@@ -4,10 +4,36 @@
 #include "settings.h"
 #include "project.h"
 #include "queue.h"
+#include "pipeline.h"
+#include "mask.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+
+//  Every operator new in the program is counted, so "mkdetect queue" can 
+//  tell whether frames flow without touching the heap.
+static std::atomic<long> heap_allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *ret = malloc(size ? size : 1);
+    if (!ret) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
 
 
 void crop_center(unsigned char *buf, int inx, int iny, int outx, int outy, int bpp) {
@@ -23,39 +49,17 @@ void crop_center(unsigned char *buf, int inx, int iny, int outx, int outy, int b
 
 char const *squarename = NULL;
 char const *dumpname = NULL;
+char const *groundname = NULL;
 
-int main(int argc, char const *argv[]) {
-    load_settings("camcam");
-    read_analyzer_settings();
-    if (argv[1] && !strcmp(argv[1], "dump")) {
-        if (argc < 4) {
-            goto usage;
-        }
-        dumpname = argv[2];
-        argv += 2;
-        argc -= 2;
-    }
-    if (argv[1] && !strcmp(argv[1], "square")) {
-        if (argc < 4) {
-            goto usage;
-        }
-        squarename = argv[2];
-        argv += 2;
-        argc -= 2;
-    }
-    if (argc != 2 || argv[1][0] == '-') {
-usage:
-        fprintf(stderr, "usage: mkdetect [dump output.png] input.{png,yuv}\n");
-        exit(1);
-    }
-    int x = 0, y = 0, n = 0;
+unsigned char *load_input(char const *name, int &x, int &y) {
+    int n = 0;
     unsigned char *buf = 0;
-    if (!strchr(argv[1], '.')) {
-        fprintf(stderr, "%s: unknown file extension\n", argv[1]);
-        exit(1);
+    if (!strchr(name, '.')) {
+        fprintf(stderr, "%s: unknown file extension\n", name);
+        return NULL;
     }
-    if (!strcmp(strrchr(argv[1], '.'), ".yuv")) {
-        FILE *f = fopen(argv[1], "rb");
+    if (!strcmp(strrchr(name, '.'), ".yuv")) {
+        FILE *f = fopen(name, "rb");
         fseek(f, 0, 2);
         unsigned long l = ftell(f);
         rewind(f);
@@ -73,35 +77,653 @@ usage:
         n = 1;
         x = (int)floorf(sqrtf(npix * 4 / 3));
         y = npix / x;
-        fprintf(stderr, "%s: assuming %dx%d size\n", argv[1], x, y);
+        fprintf(stderr, "%s: assuming %dx%d size\n", name, x, y);
     } else {
-        buf = stbi_load(argv[1], &x, &y, &n, 1);
+        buf = stbi_load(name, &x, &y, &n, 1);
     }
     if (!buf) {
-        fprintf(stderr, "%s: could not load image\n", argv[1]);
-        exit(2);
+        fprintf(stderr, "%s: could not load image\n", name);
+        return NULL;
     }
     if (x < PROC_WIDTH || y < PROC_HEIGHT) {
-        fprintf(stderr, "%s: must be at least %dx%d pixels\n", argv[1], PROC_WIDTH, PROC_HEIGHT);
-        exit(2);
+        fprintf(stderr, "%s: must be at least %dx%d pixels\n", name, PROC_WIDTH, PROC_HEIGHT);
+        return NULL;
     }
     if (x > PROC_WIDTH || y > PROC_HEIGHT) {
         crop_center(buf, x, y, PROC_WIDTH, PROC_HEIGHT, 1);
-        fprintf(stderr, "%s: cropping from %dx%d to %dx%d\n", argv[1], x, y, PROC_WIDTH, PROC_HEIGHT);
+        fprintf(stderr, "%s: cropping from %dx%d to %dx%d\n", name, x, y, PROC_WIDTH, PROC_HEIGHT);
+    }
+    return buf;
+}
+
+//  Compare each detect_color_inner() kernel against the float reference 
+//  classifier. The table must match exactly; the fixed-point kernel is 
+//  allowed to disagree on a few pixels right at the edge of the ellipsoid.
+#define FIXED_TOLERANCE 0.002f
+
+//  Label the classified picture in one band and in several, which must 
+//  give the same clusters and runs.
+#define CHECK_CLUSTERS 2048
+#define MAP_VIEW_SIZE 256
+
+static bool check_label_threads(char const *name, unsigned char const *cls) {
+    static ClusterRun runs[2][(PROC_WIDTH + 1) / 2 * PROC_HEIGHT];
+    static Cluster clusters[2][CHECK_CLUSTERS];
+    int nruns[2], ncl[2], nerr[2];
+    int oldthreads = detect_set_label_threads(1);
+    for (int t = 0; t != 2; ++t) {
+        detect_set_label_threads(t ? 4 : 1);
+        ncl[t] = detect_clusters_occupancy(128, cls, PROC_WIDTH, PROC_HEIGHT, runs[t], (PROC_WIDTH + 1) / 2 * PROC_HEIGHT,
+                &nruns[t], clusters[t], CHECK_CLUSTERS, 1, &nerr[t]);
+    }
+    detect_set_label_threads(oldthreads);
+    if (ncl[0] != ncl[1] || nruns[0] != nruns[1] || nerr[0] != nerr[1]
+            || memcmp(clusters[0], clusters[1], sizeof(Cluster) * ncl[0])
+            || memcmp(runs[0], runs[1], sizeof(ClusterRun) * nruns[0])) {
+        fprintf(stderr, "%s: labeling in bands differs: %d clusters %d runs, not %d clusters %d runs\n",
+                name, ncl[1], nruns[1], ncl[0], nruns[0]);
+        return false;
+    }
+    return true;
+}
+
+//  Erode and dilate the classified picture a word at a time, and cell by 
+//  cell; also at a width that leaves row padding, to cover the last word.
+static bool check_morphology(char const *name, unsigned char const *cls) {
+    static unsigned char mask[MASK_SIZE(PROC_WIDTH, PROC_HEIGHT)];
+    static unsigned char out[MASK_SIZE(PROC_WIDTH, PROC_HEIGHT)];
+    static unsigned char tmp[MASK_SIZE(PROC_WIDTH, PROC_HEIGHT)];
+    int widths[2] = { PROC_WIDTH, PROC_WIDTH - 21 };
+    for (int wi = 0; wi != 2; ++wi) {
+        int w = widths[wi];
+        int stride = MASK_STRIDE(w);
+        memset(mask, 0, sizeof(mask));
+        for (int y = 0; y != PROC_HEIGHT; ++y) {
+            for (int x = 0; x != w; ++x) {
+                if (cls[y * PROC_WIDTH + x]) {
+                    mask[y * stride + (x >> 3)] |= 1 << (x & 7);
+                }
+            }
+        }
+        for (int dilate = 0; dilate != 2; ++dilate) {
+            mask_morph_3x3(mask, out, tmp, w, PROC_HEIGHT, dilate);
+            for (int y = 0; y != PROC_HEIGHT; ++y) {
+                for (int x = 0; x != stride * 8; ++x) {
+                    int want = !dilate;
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int yy = y + dy, xx = x + dx;
+                            if (yy < 0 || yy >= PROC_HEIGHT || xx < 0 || xx >= w) {
+                                continue;
+                            }
+                            if (mask_get(mask, stride, xx, yy) == dilate) {
+                                want = dilate;
+                            }
+                        }
+                    }
+                    if (x >= w) {
+                        want = 0;
+                    }
+                    if (mask_get(out, stride, x, y) != want) {
+                        fprintf(stderr, "%s: %s at width %d differs at %d,%d\n", name, dilate ? "dilate" : "erode", w, x, y);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//  The staged analyzer classifies a whole frame into a mask on one core and 
+//  steers from the mask on another; that must find the same clusters as 
+//  steering from the YUV frame, which only classifies the pixels it samples.
+static bool check_staged(char const *name, unsigned char const *yuv, unsigned char *mask) {
+    static ClusterRun runs[2][(PROJECT_WIDTH + 1) / 2 * PROJECT_HEIGHT];
+    static Cluster clusters[2][CHECK_CLUSTERS];
+    int nruns[2], ncl[2];
+    Frame *f = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
+    f->width_ = PROJECT_WIDTH;
+    f->height_ = PROJECT_HEIGHT;
+    detect_color_mask(yuv, mask, PROC_WIDTH, PROC_HEIGHT);
+    for (int t = 0; t != 2; ++t) {
+        DetectOutput output = { 0 };
+        determine_steering_format(t ? mask : yuv, t ? FRAME_FORMAT_MASK : FRAME_FORMAT_YUV420, PROC_WIDTH, PROC_HEIGHT, f, &output);
+        nruns[t] = std::min(output.num_runs, (PROJECT_WIDTH + 1) / 2 * PROJECT_HEIGHT);
+        ncl[t] = std::min(output.num_clusters, CHECK_CLUSTERS);
+        memcpy(runs[t], output.runs, sizeof(ClusterRun) * nruns[t]);
+        memcpy(clusters[t], output.clusters, sizeof(Cluster) * ncl[t]);
+    }
+    delete f;
+    if (ncl[0] != ncl[1] || nruns[0] != nruns[1]
+            || memcmp(clusters[0], clusters[1], sizeof(Cluster) * ncl[0])
+            || memcmp(runs[0], runs[1], sizeof(ClusterRun) * nruns[0])) {
+        fprintf(stderr, "%s: steering from a mask differs: %d clusters %d runs, not %d clusters %d runs\n",
+                name, ncl[1], nruns[1], ncl[0], nruns[0]);
+        return false;
+    }
+    return true;
+}
+
+int check_classifier(int argc, char const *argv[]) {
+    unsigned char *fast = (unsigned char *)malloc(PROC_WIDTH * PROC_HEIGHT);
+    unsigned char *ref = (unsigned char *)malloc(PROC_WIDTH * PROC_HEIGHT);
+    unsigned char *mask = (unsigned char *)malloc(MASK_SIZE(PROC_WIDTH, PROC_HEIGHT));
+    unsigned char *unmasked = (unsigned char *)malloc(PROC_WIDTH * PROC_HEIGHT);
+    int kernels[] = { DETECT_KERNEL_TABLE, DETECT_KERNEL_FIXED };
+    int nbad[2] = { 0, 0 };
+    long ndiff_total[2] = { 0, 0 };
+    int nbadlabel = 0;
+    int nbadmorph = 0;
+    int nbadstaged = 0;
+    int oldkernel = detect_get_kernel();
+    for (int i = 0; i != argc; ++i) {
+        int x = 0, y = 0;
+        unsigned char *buf = load_input(argv[i], x, y);
+        if (!buf) {
+            exit(2);
+        }
+        detect_color_reference(buf, ref, PROC_WIDTH, PROC_HEIGHT);
+        if (!check_label_threads(argv[i], ref)) {
+            ++nbadlabel;
+        }
+        if (!check_morphology(argv[i], ref)) {
+            ++nbadmorph;
+        }
+        if (!check_staged(argv[i], buf, mask)) {
+            ++nbadstaged;
+        }
+        for (int k = 0; k != 2; ++k) {
+            detect_set_kernel(detect_kernel_name(kernels[k]));
+            detect_color_inner(buf, fast, PROC_WIDTH, PROC_HEIGHT);
+            int ndiff = 0;
+            for (int j = 0; j != PROC_WIDTH * PROC_HEIGHT; ++j) {
+                if (fast[j] != ref[j]) {
+                    ++ndiff;
+                }
+            }
+            ndiff_total[k] += ndiff;
+            detect_color_mask(buf, mask, PROC_WIDTH, PROC_HEIGHT);
+            mask_to_bytes(mask, unmasked, PROC_WIDTH, PROC_HEIGHT);
+            if (memcmp(unmasked, fast, PROC_WIDTH * PROC_HEIGHT)) {
+                fprintf(stderr, "%s: %s: mask output differs from byte output\n", argv[i], detect_kernel_name(kernels[k]));
+                ++nbad[k];
+            }
+            float limit = (kernels[k] == DETECT_KERNEL_FIXED) ? FIXED_TOLERANCE * PROC_WIDTH * PROC_HEIGHT : 0;
+            if (ndiff > limit) {
+                fprintf(stderr, "%s: %s: %d pixels differ from reference\n", argv[i], detect_kernel_name(kernels[k]), ndiff);
+                ++nbad[k];
+            }
+        }
+        free(buf);
+    }
+    detect_set_kernel(detect_kernel_name(oldkernel));
+    for (int k = 0; k != 2; ++k) {
+        fprintf(stderr, "check: %s: %d of %d files differ (%ld pixels total)\n",
+                detect_kernel_name(kernels[k]), nbad[k], argc, ndiff_total[k]);
+    }
+    fprintf(stderr, "check: label bands: %d of %d files differ\n", nbadlabel, argc);
+    fprintf(stderr, "check: morphology: %d of %d files differ\n", nbadmorph, argc);
+    fprintf(stderr, "check: staged: %d of %d files differ\n", nbadstaged, argc);
+    free(fast);
+    free(ref);
+    free(mask);
+    free(unmasked);
+    return (nbad[0] || nbad[1] || nbadlabel || nbadmorph || nbadstaged) ? 1 : 0;
+}
+
+//  Run a sequence of frames through steering, and print how the clusters 
+//  are tracked from one to the next.
+int track_sequence(int argc, char const *argv[]) {
+    Frame *f = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
+    f->width_ = PROJECT_WIDTH;
+    f->height_ = PROJECT_HEIGHT;
+    int nmatched = 0, ntracks = 0;
+    for (int i = 0; i != argc; ++i) {
+        int x = 0, y = 0;
+        unsigned char *buf = load_input(argv[i], x, y);
+        if (!buf) {
+            exit(2);
+        }
+        DetectOutput output = { 0 };
+        determine_steering_format(buf, FRAME_FORMAT_YUV420, x, y, f, &output);
+        fprintf(stderr, "%s: steer=%.2f clusters=%d tracks=%d\n", argv[i], output.steer, output.num_clusters, output.num_tracks);
+        for (int j = 0; j != output.num_tracks; ++j) {
+            ClusterTrack const &t = output.tracks[j];
+            fprintf(stderr, "  track %d  age=%d missed=%d cluster=%d at (%.1f, %.1f) moving (%.2f, %.2f)\n",
+                    t.id, t.age, t.missed, t.cluster, t.x, t.y, t.vx, t.vy);
+            if (t.cluster >= 0 && t.age > 1) {
+                ++nmatched;
+            }
+        }
+        ntracks += output.num_tracks;
+        free(buf);
+    }
+    fprintf(stderr, "track: %d frames, %d tracks, %d matched from the frame before\n", argc, ntracks, nmatched);
+    delete f;
+    return 0;
+}
+
+//  Steer each frame by clusters and by Hough lines, side by side.
+int compare_detectors(int argc, char const *argv[]) {
+    static char const *names[2] = { "clusters", "hough" };
+    Frame *f = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
+    f->width_ = PROJECT_WIDTH;
+    f->height_ = PROJECT_HEIGHT;
+    char olddetector[32];
+    snprintf(olddetector, sizeof(olddetector), "%s", detect_detector_name());
+    int nsteered[2] = { 0, 0 };
+    float totaldiff = 0;
+    int nboth = 0;
+    for (int i = 0; i != argc; ++i) {
+        int x = 0, y = 0;
+        unsigned char *buf = load_input(argv[i], x, y);
+        if (!buf) {
+            exit(2);
+        }
+        DetectOutput output[2];
+        int err[2];
+        for (int d = 0; d != 2; ++d) {
+            memset(&output[d], 0, sizeof(output[d]));
+            detect_set_detector(names[d]);
+            err[d] = determine_steering_format(buf, FRAME_FORMAT_YUV420, x, y, f, &output[d]);
+            if (!err[d]) {
+                ++nsteered[d];
+            }
+        }
+        fprintf(stderr, "%s: clusters steer=%.2f drive=%.2f  hough steer=%.2f drive=%.2f lines=%d\n", argv[i],
+                output[0].steer, output[0].drive, output[1].steer, output[1].drive, output[1].num_lines);
+        if (!err[0] && !err[1]) {
+            totaldiff += fabsf(output[0].steer - output[1].steer);
+            ++nboth;
+        }
+        free(buf);
+    }
+    detect_set_detector(olddetector);
+    fprintf(stderr, "ab: %d frames; clusters steered %d, hough steered %d; mean steer difference %.2f\n",
+            argc, nsteered[0], nsteered[1], nboth ? totaldiff / nboth : 0.0f);
+    delete f;
+    return 0;
+}
+
+//  Push frames through queues and a Pipeline the way camcam does: this 
+//  thread writes camera frames, the pipeline workers link the input to 
+//  their output, the ordered step links a side frame (like the flat map) 
+//  and checks that frames still come in order, and a third thread (the 
+//  GUI) reads and recycles the chain. After the threads are going, none 
+//  of it may allocate. The first pass waits for room in the input, so every 
+//  frame must reach the pipeline; the second overwrites unread frames like 
+//  the analyzer input, so every frame must be read or overwritten.
+#define QUEUE_WARMUP 100
+
+static FrameQueue *queue_side;
+static std::atomic<bool> queue_done(false);
+static std::atomic<int> queue_read(0);
+static int queue_last = -1;
+static int queue_disordered;
+static int queue_seen;
+
+static void queue_process(Pipeline *, Frame *&inFrame, Frame *&outFrame, void *) {
+    //  finish in a different order than started, now and then
+    int seq;
+    memcpy(&seq, inFrame->data_, sizeof(seq));
+    for (int i = 0; i != (seq & 3); ++i) {
+        sched_yield();
+    }
+    if (outFrame) {
+        memcpy(outFrame->data_, &seq, sizeof(seq));
+        outFrame->link(inFrame);
+        inFrame = NULL;
+    }
+}
+
+static void queue_ordered(Pipeline *, Frame *inFrame, Frame *, void *) {
+    int seq;
+    memcpy(&seq, inFrame->data_, sizeof(seq));
+    if (seq <= queue_last) {
+        ++queue_disordered;
+    }
+    queue_last = seq;
+    ++queue_seen;
+    Frame *side = queue_side->beginWrite();
+    if (side) {
+        inFrame->link(side);
+    }
+}
+
+static void *queue_reader(void *arg) {
+    FrameQueue *q = (FrameQueue *)arg;
+    while (!queue_done.load() || !q->readEmpty()) {
+        Frame *f = q->beginRead();
+        if (!f) {
+            sched_yield();
+            continue;
+        }
+        queue_read.fetch_add(1);
+        f->recycle();
+    }
+    return NULL;
+}
+
+static int queue_pass(int nframes, int workers, int policy) {
+    queue_done.store(false);
+    queue_read.store(0);
+    queue_last = -1;
+    queue_disordered = 0;
+    queue_seen = 0;
+    FrameQueue input(workers + 1, 64, 8, 8, FRAME_FORMAT_GRAY);
+    input.setPolicy(policy);
+    FrameQueue output(1, 64, 8, 8, FRAME_FORMAT_GRAY);
+    FrameQueue side(1, 64, 8, 8, FRAME_FORMAT_GRAY);
+    queue_side = &side;
+    Pipeline pipe(queue_process);
+    pipe.connectInput(&input);
+    pipe.connectOutput(&output);
+    pipe.setOrdered(queue_ordered);
+    pipe.setWorkers(workers);
+    pipe.start(NULL);
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, queue_reader, &output)) {
+        fprintf(stderr, "queue: pthread_create() failed\n");
+        return 2;
+    }
+    long before = 0;
+    int nwritten = 0, nmissed = 0;
+    while (nwritten != QUEUE_WARMUP + nframes) {
+        if (nwritten == QUEUE_WARMUP) {
+            before = heap_allocations.load();
+        }
+        Frame *f = input.beginWrite();
+        if (!f) {
+            ++nmissed;
+            sched_yield();
+            continue;
+        }
+        memcpy(f->data_, &nwritten, sizeof(nwritten));
+        f->endWrite();
+        ++nwritten;
+        //  a camera doesn't write as fast as it can, but sometimes faster 
+        //  than the reader keeps up
+        if (!(nwritten % 4)) {
+            sched_yield();
+        }
+    }
+    //  let the pipeline drain before counting
+    int nin, nout, nflight, nover;
+    do {
+        sched_yield();
+        input.getStats(nin, nout, nflight, nover);
+    } while (nin != workers + 1);
+    long allocations = heap_allocations.load() - before;
+    queue_done.store(true);
+    pthread_join(reader, NULL);
+    pipe.stop();
+    bool latest = policy == FRAME_POLICY_LATEST;
+    //  a frame that is neither processed nor overwritten was lost
+    int nlost = nwritten - queue_seen - nover;
+    fprintf(stderr, "queue: %s, %d workers, %d frames written (%d times full, %d overwritten), "
+            "%d processed, %d read, %d out of order, %d lost, %ld heap allocations\n",
+            latest ? "latest" : "drop new", workers, nframes, nmissed, nover, queue_seen,
+            queue_read.load(), queue_disordered, nlost, allocations);
+    if (allocations || queue_disordered || nlost) {
+        return 1;
+    }
+    //  overwriting must actually happen for the second pass to mean anything
+    if (latest ? !nover : nover != 0) {
+        fprintf(stderr, "queue: expected %s overwritten frames\n", latest ? "some" : "no");
+        return 1;
+    }
+    return 0;
+}
+
+int queue_frames(int nframes, int workers) {
+    workers = workers < 1 ? 1 : workers > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : workers;
+    int err = queue_pass(nframes, workers, FRAME_POLICY_DROP_NEW);
+    return err ? err : queue_pass(nframes, workers, FRAME_POLICY_LATEST);
+}
+
+//  Steer a sequence of frames through a two-stage PipelineChain built like 
+//  camcam's analyzer_staged (classify into a mask on one thread, steer from 
+//  it on another, both queues keeping the latest frames,) and compare with 
+//  steering each frame in turn. Like the camera, the writer never waits; 
+//  frames dropped or overwritten on the way are skipped, but the ones that 
+//  get through must come in order, and every frame must come back.
+#define STAGES_DEPTH 2
+#define STAGES_INPUT (STAGES_DEPTH + 3)
+
+static int stages_seq[FRAME_QUEUE_MAX];     //  by input Frame::index_
+static float *stages_steer;
+static bool *stages_done;
+static int stages_last = -1;
+static int stages_disordered;
+
+static void stages_classify(Pipeline *, Frame *&inFrame, Frame *&outFrame, void *) {
+    if (outFrame) {
+        detect_color_mask(inFrame->data_, outFrame->data_, PROC_WIDTH, PROC_HEIGHT);
+        outFrame->link(inFrame);
+        inFrame = NULL;
+    }
+}
+
+static void stages_steer_mask(Pipeline *, Frame *&inFrame, Frame *&, void *data) {
+    Frame *flat = (Frame *)data;
+    Frame *camera = inFrame->link_;
+    DetectOutput output = { 0 };
+    determine_steering_format(inFrame->data_, FRAME_FORMAT_MASK, PROC_WIDTH, PROC_HEIGHT, flat, &output);
+    int seq = stages_seq[camera->index_];
+    stages_steer[seq] = output.steer;
+    stages_done[seq] = true;
+    if (seq <= stages_last) {
+        ++stages_disordered;
+    }
+    stages_last = seq;
+}
+
+int stage_sequence(int argc, char const *argv[]) {
+    Frame *flat = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
+    flat->width_ = PROJECT_WIDTH;
+    flat->height_ = PROJECT_HEIGHT;
+    std::vector<unsigned char *> frames;
+    std::vector<float> want;
+    for (int i = 0; i != argc; ++i) {
+        int x = 0, y = 0;
+        unsigned char *buf = load_input(argv[i], x, y);
+        if (!buf) {
+            exit(2);
+        }
+        DetectOutput output = { 0 };
+        determine_steering_format(buf, FRAME_FORMAT_YUV420, x, y, flat, &output);
+        frames.push_back(buf);
+        want.push_back(output.steer);
+    }
+    stages_steer = new float[argc];
+    stages_done = new bool[argc]();
+    FrameQueue input(STAGES_INPUT, PROC_WIDTH * PROC_HEIGHT * 6 / 4, PROC_WIDTH, PROC_HEIGHT, FRAME_FORMAT_YUV420);
+    input.setPolicy(FRAME_POLICY_LATEST);
+    PipelineChain chain;
+    chain.input(&input)
+        .stage("classify", stages_classify, STAGES_DEPTH, MASK_SIZE(PROC_WIDTH, PROC_HEIGHT),
+                PROC_WIDTH, PROC_HEIGHT, FRAME_FORMAT_MASK)
+            .policy(FRAME_POLICY_LATEST)
+        .stage("steer", stages_steer_mask, NULL);
+    FrameQueue *masks = chain.stageOutput(0);
+    chain.start(flat);
+    int nmissed = 0;
+    for (int i = 0; i != argc; ++i) {
+        Frame *f = input.beginWrite();
+        if (!f) {
+            ++nmissed;
+        } else {
+            memcpy(f->data_, frames[i], f->size_);
+            stages_seq[f->index_] = i;
+            f->endWrite();
+        }
+        //  a camera doesn't write as fast as it can, but sometimes faster 
+        //  than the stages keep up
+        if (!(i % 4)) {
+            sched_yield();
+        }
+    }
+    //  let the chain drain; a frame that doesn't come back is a leak
+    int nin = 0, nout, nflight, nover = 0;
+    int min = 0, mout, mflight, mover = 0;
+    for (int i = 0; i != 2000 && (nin != STAGES_INPUT || min != STAGES_DEPTH); ++i) {
+        usleep(1000);
+        input.getStats(nin, nout, nflight, nover);
+        masks->getStats(min, mout, mflight, mover);
+    }
+    chain.stop();
+    int nleaked = (STAGES_INPUT - nin) + (STAGES_DEPTH - min);
+    int nsteered = 0, ndiff = 0;
+    for (int i = 0; i != argc; ++i) {
+        if (!stages_done[i]) {
+            continue;
+        }
+        ++nsteered;
+        if (stages_steer[i] != want[i]) {
+            fprintf(stderr, "%s: staged steer=%.3f, not %.3f\n", argv[i], stages_steer[i], want[i]);
+            ++ndiff;
+        }
+    }
+    fprintf(stderr, "stages: %d frames (%d times full, %d overwritten), %d masks overwritten, "
+            "%d through both stages, %d steer differently, %d out of order, %d frames not returned\n",
+            argc, nmissed, nover, mover, nsteered, ndiff, stages_disordered, nleaked);
+    for (size_t i = 0; i != frames.size(); ++i) {
+        free(frames[i]);
+    }
+    delete[] stages_steer;
+    delete[] stages_done;
+    delete flat;
+    return (ndiff || stages_disordered || nleaked || !nsteered) ? 1 : 0;
+}
+
+//  Run a sequence of frames into the ground map, and write what it holds.
+//  There is no odometry in saved frames, so the rover stays put.
+int map_sequence(char const *outname, int argc, char const *argv[]) {
+    Frame *f = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
+    f->width_ = PROJECT_WIDTH;
+    f->height_ = PROJECT_HEIGHT;
+    int oldmap = detect_set_ground_map(1);
+    for (int i = 0; i != argc; ++i) {
+        int x = 0, y = 0;
+        unsigned char *buf = load_input(argv[i], x, y);
+        if (!buf) {
+            exit(2);
+        }
+        DetectOutput output = { 0 };
+        determine_steering_format(buf, FRAME_FORMAT_YUV420, x, y, f, &output);
+        free(buf);
+    }
+    detect_set_ground_map(oldmap);
+    static unsigned char view[MAP_VIEW_SIZE * MAP_VIEW_SIZE];
+    detect_ground_map_view(view, MAP_VIEW_SIZE, MAP_VIEW_SIZE);
+    int nset = 0;
+    for (size_t i = 0; i != sizeof(view); ++i) {
+        nset += view[i] >= 128;
+    }
+    fprintf(stderr, "map: %d frames, %d cells mostly set\n", argc, nset);
+    delete f;
+    if (!stbi_write_png(outname, MAP_VIEW_SIZE, MAP_VIEW_SIZE, 1, view, 0)) {
+        fprintf(stderr, "%s: could not write\n", outname);
+        return 2;
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[]) {
+    load_settings("camcam");
+    read_analyzer_settings();
+    if (argv[1] && !strcmp(argv[1], "check")) {
+        if (argc < 3) {
+            goto usage;
+        }
+        return check_classifier(argc - 2, argv + 2);
+    }
+    if (argv[1] && !strcmp(argv[1], "ab")) {
+        if (argc < 3) {
+            goto usage;
+        }
+        return compare_detectors(argc - 2, argv + 2);
+    }
+    if (argv[1] && !strcmp(argv[1], "track")) {
+        if (argc < 3) {
+            goto usage;
+        }
+        return track_sequence(argc - 2, argv + 2);
+    }
+    if (argv[1] && !strcmp(argv[1], "queue")) {
+        return queue_frames(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 1);
+    }
+    if (argv[1] && !strcmp(argv[1], "stages")) {
+        if (argc < 3) {
+            goto usage;
+        }
+        return stage_sequence(argc - 2, argv + 2);
+    }
+    if (argv[1] && !strcmp(argv[1], "map")) {
+        if (argc < 4) {
+            goto usage;
+        }
+        return map_sequence(argv[2], argc - 3, argv + 3);
+    }
+    if (argv[1] && !strcmp(argv[1], "dump")) {
+        if (argc < 4) {
+            goto usage;
+        }
+        dumpname = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argv[1] && !strcmp(argv[1], "square")) {
+        if (argc < 4) {
+            goto usage;
+        }
+        squarename = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argv[1] && !strcmp(argv[1], "ground")) {
+        if (argc < 4) {
+            goto usage;
+        }
+        groundname = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 2 || argv[1][0] == '-') {
+usage:
+        fprintf(stderr, "usage: mkdetect [dump output.png] [square output.png] [ground output.png] input.{png,yuv}\n"
+                "       mkdetect check input.{png,yuv} ...\n"
+                "       mkdetect track input.{png,yuv} ...\n"
+                "       mkdetect ab input.{png,yuv} ...\n"
+                "       mkdetect map output.png input.{png,yuv} ...\n"
+                "       mkdetect queue [frames [workers]]\n"
+                "       mkdetect stages input.{png,yuv} ...\n");
+        exit(1);
+    }
+    if (groundname && (!strrchr(argv[1], '.') || strcmp(strrchr(argv[1], '.'), ".yuv"))) {
+        fprintf(stderr, "%s: the colour ground view needs a .yuv input\n", argv[1]);
+        exit(1);
+    }
+    int x = 0, y = 0;
+    unsigned char *buf = load_input(argv[1], x, y);
+    if (!buf) {
+        exit(2);
     }
-    unsigned char *an = (unsigned char *)malloc(PROC_WIDTH * PROC_HEIGHT);
-    detect_color_inner(buf, an, PROC_WIDTH, PROC_HEIGHT);
     if (dumpname) {
+        unsigned char *an = (unsigned char *)malloc(PROC_WIDTH * PROC_HEIGHT);
+        detect_color_inner(buf, an, PROC_WIDTH, PROC_HEIGHT);
         if (!stbi_write_png(dumpname, PROC_WIDTH, PROC_HEIGHT, 1, an, 0)) {
             fprintf(stderr, "%s: could not write file\n", dumpname);
             exit(3);
         }
+        free(an);
     }
     DetectOutput output = { 0 };
     Frame *f = new Frame(PROJECT_WIDTH * PROJECT_HEIGHT);
     f->width_ = PROJECT_WIDTH;
     f->height_ = PROJECT_HEIGHT;
-    determine_steering(an, x, y, f, &output);
+    determine_steering_format(buf, FRAME_FORMAT_YUV420, x, y, f, &output);
     if (squarename) {
         unsigned char *sqproj = f->data_;
         int sw = PROJECT_WIDTH;
@@ -113,11 +735,25 @@ usage:
         }
         stbi_write_png(squarename, sw, sh, 1, sqproj, 0);
     }
+    if (groundname) {
+        unsigned char *ground = (unsigned char *)malloc(PROJECT_WIDTH * PROJECT_HEIGHT * 3);
+        if (detect_project_color(buf, x, y, ground, PROJECT_PACKED_RGB) ||
+                !stbi_write_png(groundname, PROJECT_WIDTH, PROJECT_HEIGHT, 3, ground, 0)) {
+            fprintf(stderr, "%s: could not write file\n", groundname);
+            exit(3);
+        }
+        free(ground);
+    }
 
     if (output.num_clusters) {
         fprintf(stderr, "steer=%.2f\n", output.steer);
         fprintf(stderr, "drive=%.2f\n", output.drive);
         fprintf(stderr, "num_clusters=%d\n", output.num_clusters);
+        fprintf(stderr, "fit=%d/%d residual=%.2f\n", output.fit_inliers, output.fit_points, output.fit_residual);
+        for (int i = 0; i != output.num_lines; ++i) {
+            DetectLine const &l = output.lines[i];
+            fprintf(stderr, "line %d  x=%.1f%+.2fy votes=%d\n", i, l.a, l.b, l.votes);
+        }
         for (int i = 0; i != output.num_clusters; ++i) {
             Cluster const &c = output.clusters[i];
             fprintf(stderr, "cluster %d  x=(%d-%d) y=(%d-%d) count=%d label=%d\n",
@@ -1,23 +1,34 @@
 #include "pipeline.h"
 #include "queue.h"
 #include <stdio.h>
+#include <errno.h>
 #include "plock.h"
 
 
 Pipeline::Pipeline(void (*do_the_thing)(Pipeline *you, Frame *&srcData, Frame *&dstData, void *data))
     : processing_(do_the_thing)
+    , ordered_(NULL)
+    , debug_(NULL)
+    , debugData_(NULL)
     , running_(false)
-    , thread_(0)
+    , workers_(1)
+    , cpu_(-1)
+    , numThreads_(0)
+    , nextSeq_(0)
+    , nextDone_(0)
     , mutex_(PTHREAD_MUTEX_INITIALIZER)
-    , cond_(PTHREAD_COND_INITIALIZER)
+    , doneCond_(PTHREAD_COND_INITIALIZER)
     , input_(NULL)
     , output_(NULL)
+    , data_(NULL)
 {
+    sem_init(&pending_, 0, 0);
 }
 
 Pipeline::~Pipeline() {
     stop();
     connectInput(NULL);
+    sem_destroy(&pending_);
 }
 
 void Pipeline::connectInput(FrameQueue *input) {
@@ -27,7 +38,8 @@ void Pipeline::connectInput(FrameQueue *input) {
     input_ = input;
     if (input_) {
         input_->setTarget(this);
-        pthread_cond_signal(&cond_);
+        //  in case a frame was written before there was anyone to tell
+        sem_post(&pending_);
     }
 }
 
@@ -35,31 +47,63 @@ void Pipeline::connectOutput(FrameQueue *output) {
     output_ = output;
 }
 
+void Pipeline::setWorkers(int workers) {
+    PLock lock(mutex_);
+    workers_ = workers < 1 ? 1 : workers > PIPELINE_MAX_WORKERS ? PIPELINE_MAX_WORKERS : workers;
+}
+
+void Pipeline::setCpu(int cpu) {
+    PLock lock(mutex_);
+    cpu_ = cpu;
+}
+
+void Pipeline::setOrdered(void (*func)(Pipeline *, Frame *, Frame *, void *)) {
+    PLock lock(mutex_);
+    ordered_ = func;
+}
+
 void Pipeline::start(void *data) {
     PLock lock(mutex_);
-    if (!thread_) {
+    if (!numThreads_) {
         data_ = data;
         running_ = true;
-        if (pthread_create(&thread_, NULL, thread_fn, this)) {
-            fprintf(stderr, "Pipeline: pthread_create() failed\n");
-            thread_ = 0;
+        nextSeq_ = nextDone_ = 0;
+        for (int i = 0; i != workers_; ++i) {
+            if (pthread_create(&threads_[numThreads_], NULL, thread_fn, this)) {
+                fprintf(stderr, "Pipeline: pthread_create() failed\n");
+                break;
+            }
+            if (cpu_ >= 0) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu_, &cpus);
+                if (pthread_setaffinity_np(threads_[numThreads_], sizeof(cpus), &cpus)) {
+                    fprintf(stderr, "Pipeline: could not pin a worker to cpu %d\n", cpu_);
+                }
+            }
+            ++numThreads_;
+        }
+        if (!numThreads_) {
             running_ = false;
-            return;
         }
     }
 }
 
 void Pipeline::stop() {
-    if (thread_) {
+    if (numThreads_) {
         {
             PLock lock(mutex_);
             running_ = false;
-            pthread_cond_signal(&cond_);
         }
-        void *x = NULL;
-        pthread_join(thread_, &x);
+        for (int i = 0; i != numThreads_; ++i) {
+            sem_post(&pending_);
+        }
+        for (int i = 0; i != numThreads_; ++i) {
+            void *x = NULL;
+            pthread_join(threads_[i], &x);
+        }
         data_ = NULL;
-        thread_ = 0;
+        numThreads_ = 0;
     }
 }
 
@@ -84,20 +128,25 @@ void Pipeline::thread() {
     while (running_) {
         Frame *srcData = NULL;
         Frame *dstData = NULL;
+        unsigned long seq = 0;
+        //  Every frame written posts once, and every wait is followed by a 
+        //  read, so a frame can't sit unread while all workers sleep.
+        while (sem_wait(&pending_) && errno == EINTR) {
+        }
+        if (!running_) {
+            break;
+        }
         {
             PLock lock(mutex_);
-            if (!input_ || input_->readEmpty()) {
-                pthread_cond_wait(&cond_, &mutex_);
-            }
-            if (!running_) {
-                break;
-            }
             if (input_) {
                 srcData = input_->beginRead();
             }
             if (srcData && output_) {
                 dstData = output_->beginWrite();
             }
+            if (srcData) {
+                seq = nextSeq_++;
+            }
         }
         if (srcData) {
             Frame *origSrc = srcData;
@@ -117,21 +166,40 @@ void Pipeline::thread() {
                     dbfn(this, origSrc, origDst, dd);
                 }
             }
+            //  Every frame numbered before this one has been read, so its 
+            //  worker will get here and pass the turn on; stop() can't 
+            //  strand a waiter.
+            {
+                PLock lock(mutex_);
+                while (seq != nextDone_) {
+                    pthread_cond_wait(&doneCond_, &mutex_);
+                }
+            }
+            if (ordered_) {
+                ordered_(this, origSrc, origDst, data_);
+            }
             if (srcData) {
                 srcData->endRead();
             }
             if (dstData) {
                 dstData->endWrite();
             }
-        } else {
-            fprintf(stderr, "Pipeline: wakeup without data\n");
+            {
+                PLock lock(mutex_);
+                ++nextDone_;
+                pthread_cond_broadcast(&doneCond_);
+            }
         }
+        //  else a worker before us read it, or, with FRAME_POLICY_LATEST, 
+        //  the writer took it back; either is normal, so wait again
     }
     fprintf(stderr, "ending Pipeline\n");
 }
 
+//  Runs on the input queue's writer (the camera callback,) so it must not 
+//  take mutex_; a post is never lost, however it falls with the waits.
 void Pipeline::react() {
-    pthread_cond_signal(&cond_);
+    sem_post(&pending_);
 }
 
 void Pipeline::process(Frame *&srcData, Frame *&dstData) {
@@ -141,3 +209,114 @@ void Pipeline::process(Frame *&srcData, Frame *&dstData) {
 }
 
 
+PipelineChain::PipelineChain()
+    : input_(NULL)
+    , numStages_(0)
+{
+}
+
+PipelineChain::~PipelineChain() {
+    clear();
+}
+
+PipelineChain &PipelineChain::input(FrameQueue *input) {
+    input_ = input;
+    return *this;
+}
+
+PipelineChain &PipelineChain::stage(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+        size_t depth, size_t size, int width, int height, int format) {
+    return add(name, fn, new FrameQueue(depth, size, width, height, format), true);
+}
+
+PipelineChain &PipelineChain::stage(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+        FrameQueue *output) {
+    return add(name, fn, output, false);
+}
+
+PipelineChain &PipelineChain::add(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+        FrameQueue *output, bool owned) {
+    if (numStages_ == PIPELINE_MAX_STAGES) {
+        fprintf(stderr, "PipelineChain: more than %d stages; %s left out\n", PIPELINE_MAX_STAGES, name);
+        if (owned) {
+            delete output;
+        }
+        return *this;
+    }
+    Stage &st = stages_[numStages_];
+    st.name = name;
+    st.pipeline = new Pipeline(fn);
+    st.output = output;
+    st.ownsOutput = owned;
+    st.pipeline->connectInput(numStages_ ? stages_[numStages_ - 1].output : input_);
+    st.pipeline->connectOutput(output);
+    ++numStages_;
+    return *this;
+}
+
+PipelineChain &PipelineChain::ordered(void (*fn)(Pipeline *, Frame *, Frame *, void *)) {
+    if (numStages_) {
+        stages_[numStages_ - 1].pipeline->setOrdered(fn);
+    }
+    return *this;
+}
+
+PipelineChain &PipelineChain::workers(int workers) {
+    if (numStages_) {
+        stages_[numStages_ - 1].pipeline->setWorkers(workers);
+    }
+    return *this;
+}
+
+PipelineChain &PipelineChain::cpu(int cpu) {
+    if (numStages_) {
+        stages_[numStages_ - 1].pipeline->setCpu(cpu);
+    }
+    return *this;
+}
+
+PipelineChain &PipelineChain::policy(int policy) {
+    if (numStages_ && stages_[numStages_ - 1].output) {
+        stages_[numStages_ - 1].output->setPolicy(policy);
+    }
+    return *this;
+}
+
+//  the last stage first, so each one has somewhere to put its frames
+void PipelineChain::start(void *data) {
+    for (int i = numStages_; i != 0; --i) {
+        stages_[i - 1].pipeline->start(data);
+    }
+}
+
+void PipelineChain::stop() {
+    for (int i = 0; i != numStages_; ++i) {
+        stages_[i].pipeline->stop();
+    }
+}
+
+void PipelineChain::clear() {
+    stop();
+    //  each pipeline lets go of its input queue as it goes
+    for (int i = 0; i != numStages_; ++i) {
+        delete stages_[i].pipeline;
+    }
+    for (int i = 0; i != numStages_; ++i) {
+        if (stages_[i].ownsOutput) {
+            delete stages_[i].output;
+        }
+    }
+    numStages_ = 0;
+}
+
+int PipelineChain::stages() {
+    return numStages_;
+}
+
+char const *PipelineChain::stageName(int i) {
+    return (i >= 0 && i < numStages_) ? stages_[i].name : NULL;
+}
+
+FrameQueue *PipelineChain::stageOutput(int i) {
+    return (i >= 0 && i < numStages_) ? stages_[i].output : NULL;
+}
@@ -1,19 +1,37 @@
 #if !defined(pipeline_h)
 #define pipeline_h
 
+#include <atomic>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
 #include "reactive.h"
 
 class FrameQueue;
 class Frame;
 
+/* A pipeline can run its processing on up to PIPELINE_MAX_WORKERS threads 
+ * that all read from the one input queue. Frames are numbered as they are 
+ * read, and each worker waits for its turn before the ordered function 
+ * runs and the frames are passed on, so the output (and whatever the 
+ * ordered function does) stays in input order even when a later frame 
+ * finishes first. The processing function must then be safe to run on 
+ * several frames at once; work that isn't belongs in the ordered one. 
+ * The input queue's writer wakes a worker by posting a semaphore, so it 
+ * never takes the mutex the workers share.
+ */
+#define PIPELINE_MAX_WORKERS 4
+
 class Pipeline : public Reactive {
     public:
         /* note that dstData may be NULL if output queue is full */
         Pipeline(void (*do_the_thing)(Pipeline *you, Frame *&srcData, Frame *&dstData, void *data) = NULL);
-        ~Pipeline();
+        virtual ~Pipeline();
         void connectInput(FrameQueue *input);
         void connectOutput(FrameQueue *output);
+        void setWorkers(int workers);   //  before start()
+        void setCpu(int cpu);           //  before start(); -1 for any
+        void setOrdered(void (*ordered)(Pipeline *you, Frame *src, Frame *dst, void *data));
         void start(void *data);
         void stop();
         bool running();
@@ -24,17 +42,73 @@ class Pipeline : public Reactive {
         void react() override;
         virtual void process(Frame *&src, Frame *&dst);     //  by default calls processing_ if buffers are available
         void (*processing_)(Pipeline *, Frame *&, Frame *&, void *);
+        void (*ordered_)(Pipeline *, Frame *, Frame *, void *);
         void (*debug_)(Pipeline *, Frame *, Frame *, void *);
         void *debugData_;
-        volatile bool running_;
-        pthread_t thread_;
-        pthread_mutex_t mutex_;
-        pthread_cond_t cond_;
+        std::atomic<bool> running_;
+        int workers_;
+        int cpu_;
+        int numThreads_;
+        pthread_t threads_[PIPELINE_MAX_WORKERS];
+        unsigned long nextSeq_;     //  given to the next frame read
+        unsigned long nextDone_;    //  the frame whose turn it is to finish
+        pthread_mutex_t mutex_;     //  between workers only
+        pthread_cond_t doneCond_;
+        sem_t pending_;             //  posted once per frame written to input_
         FrameQueue *input_;
         FrameQueue *output_;
         void *data_;
 };
 
 
+/* Builds a chain of pipelines, each stage on its own threads (and core, if 
+ * asked,) reading what the stage before it wrote. The chain makes the 
+ * queues between stages, of the depth and frame shape each stage asks 
+ * for; the last stage may write a queue made elsewhere. Options after a 
+ * stage apply to that stage:
+ *
+ *   chain.input(&camera)
+ *       .stage("classify", classify, 2, maskSize, w, h, FRAME_FORMAT_MASK).cpu(1)
+ *       .stage("steer", steer, &toGui).cpu(2)
+ *       .start(NULL);
+ */
+#define PIPELINE_MAX_STAGES 4
+
+class PipelineChain {
+    public:
+        PipelineChain();
+        ~PipelineChain();
+        PipelineChain &input(FrameQueue *input);
+        PipelineChain &stage(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+                size_t depth, size_t size, int width, int height, int format);
+        PipelineChain &stage(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+                FrameQueue *output);
+        PipelineChain &ordered(void (*fn)(Pipeline *, Frame *, Frame *, void *));
+        PipelineChain &workers(int workers);
+        PipelineChain &cpu(int cpu);
+        PipelineChain &policy(int policy);     //  of the stage's output queue
+        void start(void *data);
+        void stop();
+        /* stop, and take the chain apart to build another */
+        void clear();
+        int stages();
+        char const *stageName(int i);
+        FrameQueue *stageOutput(int i);
+    private:
+        PipelineChain(PipelineChain const &) = delete;
+        PipelineChain &operator=(PipelineChain const &) = delete;
+        PipelineChain &add(char const *name, void (*fn)(Pipeline *, Frame *&, Frame *&, void *),
+                FrameQueue *output, bool owned);
+        struct Stage {
+            char const *name;
+            Pipeline *pipeline;
+            FrameQueue *output;
+            bool ownsOutput;
+        };
+        FrameQueue *input_;
+        Stage stages_[PIPELINE_MAX_STAGES];
+        int numStages_;
+};
+
 #endif  //  pipeline_h
 
@@ -1,7 +1,12 @@
 #include "project.h"
+#include "mask.h"
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <algorithm>
 //  apt install libglm-dev
 #define GLM_FORCE_RADIANS 1
 #include <glm/fwd.hpp>
@@ -13,6 +18,152 @@
 
 using namespace glm;
 
+//  Walk the output cells the way the per-scanline plan samples them, and 
+//  call fn(cell, srcx, srcy) for each; srcx is -1 for missing data.
+template<typename Fn>
+static void walk_project_scanlines(struct ProjectData const *inData, Fn const &fn) {
+    int idh = inData->height;
+    int idw = inData->width;
+    for (int y = 0; y < idh; ++y) {
+        int yy = inData->yPerScanline[y];
+        int x = 0;
+        if (yy >= 0 && yy < inData->inHeight) {
+            float xx = inData->xPerScanline[y];
+            float xd = inData->incrementPerScanline[y];
+            for (; x < idw; ++x) {
+                int xxi = (int)xx;
+                if (xxi >= inData->inWidth) {
+                    break;
+                }
+                fn(y * idw + x, xxi < 0 ? -1 : xxi, yy);
+                xx += xd;
+            }
+        }
+        for (; x < idw; ++x) {
+            fn(y * idw + x, -1, yy);
+        }
+    }
+}
+
+//  The same, but following the gather map when there is one, which is 
+//  what project_bitmap() does.
+template<typename Fn>
+static void walk_project_cells(struct ProjectData const *inData, Fn const &fn) {
+    if (!inData->gather) {
+        walk_project_scanlines(inData, fn);
+        return;
+    }
+    int n = inData->width * inData->height;
+    int inWidth = inData->inWidth;
+    for (int i = 0; i != n; ++i) {
+        int o = inData->gather[i];
+        if (o < 0) {
+            fn(i, -1, -1);
+        } else {
+            fn(i, o % inWidth, o / inWidth);
+        }
+    }
+}
+
+static ProjectData *alloc_project_data(int outWidth, int outHeight, bool gather) {
+    ProjectData *ret = (ProjectData *)malloc(sizeof(ProjectData)
+        + sizeof(float) * outHeight * 4
+        + (gather ? sizeof(int) * outWidth * outHeight * 2 : 0));
+    if (!ret) {
+        return NULL;
+    }
+    ret->yPerScanline = (float *)&ret[1];
+    ret->xPerScanline = ret->yPerScanline + outHeight;
+    ret->incrementPerScanline = ret->xPerScanline + outHeight;
+    ret->groundYPerScanline = ret->incrementPerScanline + outHeight;
+    ret->gather = gather ? (int *)(ret->groundYPerScanline + outHeight) : NULL;
+    ret->chromaGather = gather ? ret->gather + outWidth * outHeight : NULL;
+    ret->width = outWidth;
+    ret->height = outHeight;
+    return ret;
+}
+
+static void bake_gather(ProjectData *data) {
+    int *gather = data->gather;
+    int *chroma = data->chromaGather;
+    int inWidth = data->inWidth;
+    walk_project_scanlines(data, [=](int cell, int x, int y) {
+            gather[cell] = (x < 0) ? GATHER_MISSING : y * inWidth + x;
+            chroma[cell] = (x < 0) ? GATHER_MISSING : (y >> 1) * (inWidth >> 1) + (x >> 1);
+        });
+}
+
+static bool has_distortion(ProjectParameters const *p) {
+    return p->k1 != 0 || p->k2 != 0 || p->k3 != 0 || p->p1 != 0 || p->p2 != 0;
+}
+
+void project_distort(
+        struct ProjectParameters const *inParams,
+        float x,
+        float y,
+        float *outX,
+        float *outY)
+{
+    float f = inParams->inWidth * 0.5f / tanf(inParams->widthRadians * 0.5f);
+    float cx = inParams->inWidth * 0.5f;
+    float cy = inParams->inHeight * 0.5f;
+    float xn = (x - cx) / f;
+    float yn = (y - cy) / f;
+    float r2 = xn * xn + yn * yn;
+    float radial = 1.0f + r2 * (inParams->k1 + r2 * (inParams->k2 + r2 * inParams->k3));
+    float xd = xn * radial + 2.0f * inParams->p1 * xn * yn + inParams->p2 * (r2 + 2.0f * xn * xn);
+    float yd = yn * radial + inParams->p1 * (r2 + 2.0f * yn * yn) + 2.0f * inParams->p2 * xn * yn;
+    *outX = xd * f + cx;
+    *outY = yd * f + cy;
+}
+
+void project_undistort(
+        struct ProjectParameters const *inParams,
+        float x,
+        float y,
+        float *outX,
+        float *outY)
+{
+    //  fixed-point iteration; converges for any lens that isn't a fisheye
+    float ux = x;
+    float uy = y;
+    for (int i = 0; i != 20; ++i) {
+        float dx, dy;
+        project_distort(inParams, ux, uy, &dx, &dy);
+        ux -= dx - x;
+        uy -= dy - y;
+    }
+    *outX = ux;
+    *outY = uy;
+}
+
+//  The per-scanline plan is a straight line through the ideal pinhole 
+//  image; push each cell of it through the lens model to find the pixel 
+//  the real camera puts it at.
+static void bake_distorted_gather(ProjectData *data, ProjectParameters const *params) {
+    int idw = data->width;
+    int *gather = data->gather;
+    for (int y = 0; y < data->height; ++y) {
+        float yy = data->yPerScanline[y];
+        float xx = data->xPerScanline[y];
+        float xd = data->incrementPerScanline[y];
+        for (int x = 0; x < idw; ++x) {
+            float sx, sy;
+            project_distort(params, xx, yy, &sx, &sy);
+            int ix = (int)floorf(sx);
+            int iy = (int)floorf(sy);
+            if (ix < 0 || ix >= data->inWidth || iy < 0 || iy >= data->inHeight) {
+                gather[y * idw + x] = GATHER_MISSING;
+                data->chromaGather[y * idw + x] = GATHER_MISSING;
+            } else {
+                gather[y * idw + x] = iy * data->inWidth + ix;
+                data->chromaGather[y * idw + x] = (iy >> 1) * (data->inWidth >> 1) + (ix >> 1);
+            }
+            xx += xd;
+        }
+    }
+}
+
 
 int make_project_data(
         struct ProjectParameters const *inParams,
@@ -33,6 +184,9 @@ int make_project_data(
     if (inParams->heightOfCamera < 1e-3) {
         return -1;
     }
+    if (inParams->rowGrowth < 0.0f) {
+        return -1;
+    }
 
     *outData = NULL;
     float heightOverWidth = float(inParams->inHeight)/float(inParams->inWidth);
@@ -56,21 +210,26 @@ int make_project_data(
     ll = vec3(0.0f, 0.0f, inParams->heightOfCamera) + (ll * (inParams->heightOfCamera / -ll.z));
     float baseY = ll.y;
 
-    ProjectData *ret = (ProjectData *)malloc(sizeof(ProjectData)
-        + sizeof(float) * inParams->outHeight * 3);
-    ret->yPerScanline = (float *)&ret[1];
-    ret->xPerScanline = ret->yPerScanline + inParams->outHeight;
-    ret->incrementPerScanline = ret->xPerScanline + inParams->outHeight;
+    //  distortion can only be expressed per pixel
+    bool distorted = has_distortion(inParams);
+    ProjectData *ret = alloc_project_data(inParams->outWidth, inParams->outHeight, inParams->bakeGather || distorted);
+    if (!ret) {
+        return -1;
+    }
 
     float leftX = -inParams->outWidth * inParams->desiredOutResolution * 0.5f;
+    float growth = inParams->rowGrowth;
+    bool uniform = (growth == 0.0f || growth == 1.0f);
     for (int y = 0; y < inParams->outHeight; ++y) {
-        float wY = baseY + y * inParams->desiredOutResolution;
+        //  geometric rows: the nearest is desiredOutResolution deep
+        float rows = uniform ? y : (powf(growth, y) - 1.0f) / (growth - 1.0f);
+        float wY = baseY + rows * inParams->desiredOutResolution;
         vec3 win(project(vec3(leftX, wY, 0.0f), view, proj, viewport));
         int outy = inParams->outHeight - y - 1;
+        ret->groundYPerScanline[outy] = wY;
         ret->yPerScanline[outy] = vpHeight - win.y;
         ret->xPerScanline[outy] = win.x;
         ret->incrementPerScanline[outy] = 2.0f * (vpWidth * 0.5f - win.x) / inParams->outWidth;
-        //  todo: fit a polynomial to the distortion and get the derivative
     }
     ret->resolution = inParams->desiredOutResolution;
     ret->nearY = baseY;
@@ -78,18 +237,345 @@ int make_project_data(
     ret->height = inParams->outHeight;
     ret->inHeight = inParams->inHeight;
     ret->inWidth = inParams->inWidth;
+    if (distorted) {
+        bake_distorted_gather(ret, inParams);
+    } else if (ret->gather) {
+        bake_gather(ret);
+    }
 
     *outData = ret;
     return 0;
 }           
 
+//  The same pinhole camera make_project_data() builds with glm, written 
+//  out, so the pitch can change without building matrices.
+struct PitchedCamera {
+    float height;
+    float focal;
+    float cx;
+    float cy;
+    float c;
+    float s;
+};
+
+static void pitched_camera(ProjectParameters const *params, float angledDown, PitchedCamera &cam) {
+    cam.height = params->heightOfCamera;
+    cam.focal = params->inWidth * 0.5f / tanf(params->widthRadians * 0.5f);
+    cam.cx = params->inWidth * 0.5f;
+    cam.cy = params->inHeight * 0.5f;
+    cam.c = cosf(angledDown);
+    cam.s = sinf(angledDown);
+}
+
+int project_set_pitch(
+        struct ProjectParameters const *inParams,
+        struct ProjectData *ioData,
+        float angledDownRadians)
+{
+    float halfFovy = atanf(tanf(inParams->widthRadians * 0.5f) * inParams->inHeight / inParams->inWidth);
+    float bottomRay = angledDownRadians + halfFovy;
+    if (angledDownRadians < 0.0f || bottomRay >= float(M_PI) * 0.5f) {
+        return -1;
+    }
+    PitchedCamera cam;
+    pitched_camera(inParams, angledDownRadians, cam);
+    //  The ground at the bottom center of the picture. make_project_data() 
+    //  aims from the ground origin at the far-plane point of that ray, not 
+    //  from the camera, which lands a little nearer; do the same, so plans 
+    //  agree at the same pitch.
+    float t = cam.height * 100.0f / cosf(halfFovy);
+    float baseY = t * cosf(bottomRay) * cam.height / (t * sinf(bottomRay) - cam.height);
+    int outW = ioData->width;
+    int outH = ioData->height;
+    float res = inParams->desiredOutResolution;
+    float leftX = -outW * res * 0.5f;
+    float growth = inParams->rowGrowth;
+    bool uniform = (growth == 0.0f || growth == 1.0f);
+    for (int y = 0; y < outH; ++y) {
+        float rows = uniform ? y : (powf(growth, y) - 1.0f) / (growth - 1.0f);
+        float wY = baseY + rows * res;
+        float zc = wY * cam.c + cam.height * cam.s;
+        float yc = wY * cam.s - cam.height * cam.c;
+        float sx = cam.cx + cam.focal * leftX / zc;
+        int outy = outH - y - 1;
+        ioData->yPerScanline[outy] = cam.cy - cam.focal * yc / zc;
+        ioData->xPerScanline[outy] = sx;
+        ioData->incrementPerScanline[outy] = 2.0f * (cam.cx - sx) / outW;
+        ioData->groundYPerScanline[outy] = wY;
+    }
+    ioData->nearY = baseY;
+    if (ioData->gather) {
+        if (has_distortion(inParams)) {
+            bake_distorted_gather(ioData, inParams);
+        } else {
+            bake_gather(ioData);
+        }
+    }
+    return 0;
+}
+
+int project_image_to_ground(
+        struct ProjectParameters const *inParams,
+        float angledDownRadians,
+        float x,
+        float y,
+        float *outX,
+        float *outY)
+{
+    PitchedCamera cam;
+    pitched_camera(inParams, angledDownRadians, cam);
+    float xc = (x - cam.cx) / cam.focal;
+    float yc = (cam.cy - y) / cam.focal;
+    //  the ray through the pixel, and where it meets the ground
+    float dy = cam.c + yc * cam.s;
+    float dz = yc * cam.c - cam.s;
+    if (dz > -1e-5f) {
+        return -1;
+    }
+    float t = cam.height / -dz;
+    *outX = xc * t;
+    *outY = dy * t;
+    return 0;
+}
+
 void free_project_data(
         struct ProjectData *freeData) {
     free(freeData);
 }
 
+void project_cell_ground(
+        struct ProjectData const *inData,
+        float x,
+        float y,
+        float *outX,
+        float *outY)
+{
+    *outX = (x + 0.5f - inData->width * 0.5f) * inData->resolution;
+    //  rows in between are interpolated
+    int row = (int)floorf(y);
+    if (row < 0) {
+        row = 0;
+    }
+    if (row > inData->height - 2) {
+        row = inData->height - 2;
+    }
+    float f = y - row;
+    *outY = inData->groundYPerScanline[row] * (1.0f - f) + inData->groundYPerScanline[row + 1] * f;
+}
 
+#define PLAN_MAGIC "mpvplan3"
 
+struct PlanFileHeader {
+    char magic[8];
+    ProjectParameters params;
+    float resolution;
+    float nearY;
+    int hasGather;
+};
+
+static size_t plan_array_size(ProjectData const *data) {
+    return sizeof(float) * data->height * 4
+        + (data->gather ? sizeof(int) * data->width * data->height * 2 : 0);
+}
+
+int save_project_data(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        char const *path)
+{
+    PlanFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PLAN_MAGIC, 8);
+    hdr.params = *inParams;
+    hdr.resolution = inData->resolution;
+    hdr.nearY = inData->nearY;
+    hdr.hasGather = inData->gather ? 1 : 0;
+    std::string tmp(path);
+    tmp += ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        perror(tmp.c_str());
+        return -1;
+    }
+    //  the arrays are allocated back to back after the struct
+    size_t asize = plan_array_size(inData);
+    bool ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1)
+        && (fwrite(inData->yPerScanline, 1, asize, f) == asize);
+    fclose(f);
+    if (!ok || rename(tmp.c_str(), path) < 0) {
+        perror(path);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int load_project_data(
+        struct ProjectParameters const *inParams,
+        char const *path,
+        struct ProjectData **outData)
+{
+    *outData = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return -1;
+    }
+    PlanFileHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, PLAN_MAGIC, 8) ||
+            memcmp(&hdr.params, inParams, sizeof(hdr.params))) {
+        fclose(f);
+        return -2;
+    }
+    ProjectData *ret = alloc_project_data(inParams->outWidth, inParams->outHeight, hdr.hasGather != 0);
+    if (!ret) {
+        fclose(f);
+        return -1;
+    }
+    ret->resolution = hdr.resolution;
+    ret->nearY = hdr.nearY;
+    ret->inWidth = inParams->inWidth;
+    ret->inHeight = inParams->inHeight;
+    size_t asize = plan_array_size(ret);
+    bool ok = fread(ret->yPerScanline, 1, asize, f) == asize;
+    fclose(f);
+    if (!ok) {
+        free(ret);
+        return -2;
+    }
+    *outData = ret;
+    return 0;
+}
+
+//  FNV-1a over the parameters picks the file name; the file itself 
+//  carries the parameters, so a hash collision just means a re-bake.
+static unsigned int hash_params(ProjectParameters const *params) {
+    unsigned int h = 2166136261u;
+    unsigned char const *p = (unsigned char const *)params;
+    for (size_t i = 0; i != sizeof(*params); ++i) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+int make_project_data_cached(
+        struct ProjectParameters const *inParams,
+        char const *dir,
+        struct ProjectData **outData)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/camcam-plan-%08x.bin", dir, hash_params(inParams));
+    if (!load_project_data(inParams, path, outData)) {
+        return 0;
+    }
+    int err = make_project_data(inParams, outData);
+    if (!err) {
+        if (!save_project_data(inParams, *outData, path)) {
+            fprintf(stderr, "saved projection plan %s\n", path);
+        }
+    }
+    return err;
+}
+
+
+
+
+int make_project_samples(
+        struct ProjectData const *inData,
+        struct ProjectSamples **outSamples)
+{
+    *outSamples = NULL;
+    int inSize = inData->inWidth * inData->inHeight;
+    int cells = inData->width * inData->height;
+    int *srcSample = (int *)malloc(sizeof(int) * inSize);
+    if (!srcSample) {
+        return -1;
+    }
+    for (int i = 0; i != inSize; ++i) {
+        srcSample[i] = -1;
+    }
+    int inWidth = inData->inWidth;
+    walk_project_cells(inData, [=](int cell, int x, int y) {
+            if (x >= 0) {
+                srcSample[y * inWidth + x] = 0;
+            }
+        });
+    //  number the sampled pixels in raster order, so reading them 
+    //  walks forward through the source image
+    int count = 0;
+    for (int i = 0; i != inSize; ++i) {
+        if (srcSample[i] == 0) {
+            srcSample[i] = ++count;
+        }
+    }
+    ProjectSamples *ret = (ProjectSamples *)malloc(sizeof(ProjectSamples)
+        + sizeof(int) * (count * 2 + cells));
+    if (!ret) {
+        free(srcSample);
+        return -1;
+    }
+    ret->count = count;
+    ret->width = inData->width;
+    ret->height = inData->height;
+    ret->srcOffset = (int *)&ret[1];
+    ret->chromaOffset = ret->srcOffset + count;
+    ret->cellSample = ret->chromaOffset + count;
+    for (int i = 0; i != inSize; ++i) {
+        int ix = srcSample[i] - 1;
+        if (ix >= 0) {
+            int x = i % inWidth;
+            int y = i / inWidth;
+            ret->srcOffset[ix] = i;
+            ret->chromaOffset[ix] = (y >> 1) * (inWidth >> 1) + (x >> 1);
+        }
+    }
+    walk_project_cells(inData, [=](int cell, int x, int y) {
+            ret->cellSample[cell] = (x < 0) ? -1 : srcSample[y * inWidth + x] - 1;
+        });
+    free(srcSample);
+    *outSamples = ret;
+    return 0;
+}
+
+void free_project_samples(
+        struct ProjectSamples *freeSamples) {
+    free(freeSamples);
+}
+
+//  Missing cells read offset 0 and then get replaced, which the compiler 
+//  can do with a conditional select instead of a branch.
+static inline unsigned char gather_one(unsigned char const *src, int offset) {
+    unsigned char v = src[offset & ~(offset >> 31)];
+    return (offset < 0) ? MISSING_DATA : v;
+}
+
+static void project_gather(
+        struct ProjectData const *inData,
+        unsigned char const *src,
+        unsigned char *dst,
+        int bpp)
+{
+    int const *gather = inData->gather;
+    int n = inData->width * inData->height;
+    if (bpp != 1) {
+        for (int i = 0; i != n; ++i) {
+            int o = gather[i];
+            for (int j = 0; j != bpp; ++j) {
+                *dst++ = gather_one(src, o < 0 ? o : o * bpp + j);
+            }
+        }
+        return;
+    }
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        dst[i] = gather_one(src, gather[i]);
+        dst[i+1] = gather_one(src, gather[i+1]);
+        dst[i+2] = gather_one(src, gather[i+2]);
+        dst[i+3] = gather_one(src, gather[i+3]);
+    }
+    for (; i != n; ++i) {
+        dst[i] = gather_one(src, gather[i]);
+    }
+}
 
 void project_bitmap(
         struct ProjectData const *inData,
@@ -97,6 +583,10 @@ void project_bitmap(
         unsigned char *dst,
         int bpp)
 {
+    if (inData->gather) {
+        project_gather(inData, src, dst, bpp);
+        return;
+    }
     int idh = inData->height;
     int idw = inData->width;
     for (int y = 0; y < idh; ++y) {
@@ -122,7 +612,7 @@ void project_bitmap(
             } else {
                 int ix = xxi * bpp;
                 for (int j = 0; j != bpp; ++j) {
-                    scanline[j] = srcline[ix];
+                    scanline[j] = srcline[ix + j];
                 }
             }
             scanline += bpp;
@@ -131,4 +621,414 @@ void project_bitmap(
     }
 }
 
+void project_mask(
+        struct ProjectData const *inData,
+        unsigned char const *src,
+        unsigned char *dst,
+        int outMask)
+{
+    int idw = inData->width;
+    int srcStride = MASK_STRIDE(inData->inWidth);
+    int dstStride = MASK_STRIDE(idw);
+    if (outMask) {
+        memset(dst, 0, dstStride * inData->height);
+    }
+    walk_project_cells(inData, [=](int cell, int x, int y) {
+            int bit = (x < 0) ? 0 : (src[y * srcStride + (x >> 3)] >> (x & 7)) & 1;
+            if (outMask) {
+                int row = cell / idw;
+                int col = cell - row * idw;
+                dst[row * dstStride + (col >> 3)] |= bit << (col & 7);
+            } else {
+                dst[cell] = (x < 0) ? MISSING_DATA : (unsigned char)(0 - bit);
+            }
+        });
+}
+
+//  Colour ground view. The cells are gathered in chunks into planar Y, U, 
+//  V buffers, converted in place to R, G, B when asked, and interleaved 
+//  into dst. The conversion is the full range one yuv_to_rgb() uses, with 
+//  6 bit fixed point coefficients (1.140, 0.581, 0.395, 2.032 times 64.) 
+//  The scalar version defines the exact arithmetic; NEON and SSE2 match it.
+#define I420_CHUNK 256
+
+struct I420Chunk {
+    unsigned char y[I420_CHUNK];
+    unsigned char u[I420_CHUNK];
+    unsigned char v[I420_CHUNK];
+};
+
+static inline unsigned char clamp_u8(int i) {
+    return (unsigned char)(i < 0 ? 0 : i > 255 ? 255 : i);
+}
+
+static void i420_rgb_scalar(unsigned char *y, unsigned char *u, unsigned char *v, int i, int n) {
+    for (; i < n; ++i) {
+        int yy = y[i];
+        int uu = u[i] - 128;
+        int vv = v[i] - 128;
+        y[i] = clamp_u8(yy + ((73 * vv + 32) >> 6));
+        u[i] = clamp_u8(yy - ((37 * vv + 25 * uu + 32) >> 6));
+        v[i] = clamp_u8(yy + ((130 * uu + 32) >> 6));
+    }
+}
+
+static void interleave_scalar(unsigned char const *a, unsigned char const *b, unsigned char const *c,
+        unsigned char *dst, int i, int n) {
+    dst += i * 3;
+    for (; i < n; ++i) {
+        dst[0] = a[i];
+        dst[1] = b[i];
+        dst[2] = c[i];
+        dst += 3;
+    }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+//  16 cells at a time; the chunk buffers are a whole number of vectors 
+//  long, so the last partial vector can be converted too.
+static int i420_rgb_simd(unsigned char *y, unsigned char *u, unsigned char *v, int n) {
+    int16x8_t c128 = vdupq_n_s16(128);
+    int16x8_t c32 = vdupq_n_s16(32);
+    int i = 0;
+    for (; i < n; i += 8) {
+        int16x8_t yy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + i)));
+        int16x8_t uu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + i))), c128);
+        int16x8_t vv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + i))), c128);
+        int16x8_t r = vaddq_s16(yy, vshrq_n_s16(vmlaq_n_s16(c32, vv, 73), 6));
+        int16x8_t g = vsubq_s16(yy, vshrq_n_s16(vmlaq_n_s16(vmlaq_n_s16(c32, vv, 37), uu, 25), 6));
+        int16x8_t b = vaddq_s16(yy, vshrq_n_s16(vmlaq_n_s16(c32, uu, 130), 6));
+        vst1_u8(y + i, vqmovun_s16(r));
+        vst1_u8(u + i, vqmovun_s16(g));
+        vst1_u8(v + i, vqmovun_s16(b));
+    }
+    return i;
+}
+
+static int interleave_simd(unsigned char const *a, unsigned char const *b, unsigned char const *c,
+        unsigned char *dst, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t px;
+        px.val[0] = vld1q_u8(a + i);
+        px.val[1] = vld1q_u8(b + i);
+        px.val[2] = vld1q_u8(c + i);
+        vst3q_u8(dst + i * 3, px);
+    }
+    return i;
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i round6(__m128i t) {
+    return _mm_srai_epi16(_mm_add_epi16(t, _mm_set1_epi16(32)), 6);
+}
+
+//  16 cells at a time; the chunk buffers are a whole number of vectors 
+//  long, so the last partial vector can be converted too.
+static int i420_rgb_simd(unsigned char *y, unsigned char *u, unsigned char *v, int n) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i c128 = _mm_set1_epi16(128);
+    int i = 0;
+    for (; i < n; i += 16) {
+        __m128i y8 = _mm_loadu_si128((__m128i const *)(y + i));
+        __m128i u8 = _mm_loadu_si128((__m128i const *)(u + i));
+        __m128i v8 = _mm_loadu_si128((__m128i const *)(v + i));
+        __m128i r[2], g[2], b[2];
+        for (int h = 0; h != 2; ++h) {
+            __m128i yy = h ? _mm_unpackhi_epi8(y8, zero) : _mm_unpacklo_epi8(y8, zero);
+            __m128i uu = _mm_sub_epi16(h ? _mm_unpackhi_epi8(u8, zero) : _mm_unpacklo_epi8(u8, zero), c128);
+            __m128i vv = _mm_sub_epi16(h ? _mm_unpackhi_epi8(v8, zero) : _mm_unpacklo_epi8(v8, zero), c128);
+            r[h] = _mm_add_epi16(yy, round6(_mm_mullo_epi16(vv, _mm_set1_epi16(73))));
+            g[h] = _mm_sub_epi16(yy, round6(_mm_add_epi16(_mm_mullo_epi16(vv, _mm_set1_epi16(37)),
+                    _mm_mullo_epi16(uu, _mm_set1_epi16(25)))));
+            b[h] = _mm_add_epi16(yy, round6(_mm_mullo_epi16(uu, _mm_set1_epi16(130))));
+        }
+        _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(r[0], r[1]));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(g[0], g[1]));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(b[0], b[1]));
+    }
+    return i;
+}
+
+//  SSE2 has no 3-way byte shuffle; the scalar loop is store bound anyway
+static int interleave_simd(unsigned char const *, unsigned char const *, unsigned char const *,
+        unsigned char *, int) {
+    return 0;
+}
+
+#else
+
+static int i420_rgb_simd(unsigned char *, unsigned char *, unsigned char *, int) {
+    return 0;
+}
+
+static int interleave_simd(unsigned char const *, unsigned char const *, unsigned char const *,
+        unsigned char *, int) {
+    return 0;
+}
+
+#endif
+
+static void flush_i420_chunk(I420Chunk &c, int n, unsigned char *dst, int outFormat) {
+    if (outFormat == PROJECT_PACKED_RGB) {
+        int i = i420_rgb_simd(c.y, c.u, c.v, n);
+        i420_rgb_scalar(c.y, c.u, c.v, i, n);
+    }
+    interleave_scalar(c.y, c.u, c.v, dst, interleave_simd(c.y, c.u, c.v, dst, n), n);
+}
+
+static inline unsigned char gather_chroma(unsigned char const *src, int offset) {
+    unsigned char v = src[offset & ~(offset >> 31)];
+    return (offset < 0) ? 128 : v;
+}
+
+void project_i420(
+        struct ProjectData const *inData,
+        unsigned char const *src,
+        unsigned char *dst,
+        int outFormat)
+{
+    int n = inData->width * inData->height;
+    unsigned char const *srcU = src + inData->inWidth * inData->inHeight;
+    unsigned char const *srcV = srcU + (inData->inWidth >> 1) * (inData->inHeight >> 1);
+    I420Chunk chunk;
+    if (inData->gather) {
+        int const *gather = inData->gather;
+        int const *chroma = inData->chromaGather;
+        for (int base = 0; base < n; base += I420_CHUNK) {
+            int m = std::min(I420_CHUNK, n - base);
+            for (int i = 0; i != m; ++i) {
+                int o = chroma[base + i];
+                chunk.y[i] = gather_one(src, gather[base + i]);
+                chunk.u[i] = gather_chroma(srcU, o);
+                chunk.v[i] = gather_chroma(srcV, o);
+            }
+            flush_i420_chunk(chunk, m, dst + base * 3, outFormat);
+        }
+        return;
+    }
+    int inHalf = inData->inWidth >> 1;
+    walk_project_scanlines(inData, [&](int cell, int x, int y) {
+            int i = cell % I420_CHUNK;
+            if (x < 0) {
+                chunk.y[i] = MISSING_DATA;
+                chunk.u[i] = chunk.v[i] = 128;
+            } else {
+                int o = (y >> 1) * inHalf + (x >> 1);
+                chunk.y[i] = src[y * inData->inWidth + x];
+                chunk.u[i] = srcU[o];
+                chunk.v[i] = srcV[o];
+            }
+            if (i == I420_CHUNK - 1 || cell == n - 1) {
+                flush_i420_chunk(chunk, i + 1, dst + (cell - i) * 3, outFormat);
+            }
+        });
+}
+
+//  bit_prefix[b][k] is the number of set bits in b at or below bit k
+static unsigned char bit_prefix[256][8];
+
+static void init_bit_prefix() {
+    for (int b = 0; b != 256; ++b) {
+        int n = 0;
+        for (int k = 0; k != 8; ++k) {
+            n += (b >> k) & 1;
+            bit_prefix[b][k] = n;
+        }
+    }
+}
+
+//  the pixels whose centers fall in [lo, hi)
+static void pixel_span(float lo, float hi, float center, int limit, int &i0, int &i1) {
+    i0 = (int)ceilf(lo - 0.5f);
+    i1 = (int)ceilf(hi - 0.5f);
+    if (i0 < 0) {
+        i0 = 0;
+    }
+    if (i1 > limit) {
+        i1 = limit;
+    }
+    if (i1 <= i0) {
+        //  less than a pixel; same as the nearest sample
+        i0 = (int)floorf(center);
+        i1 = i0 + 1;
+    }
+}
+
+int update_project_footprint(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        struct ProjectFootprint *ioFootprint)
+{
+    int w = inData->width;
+    int h = inData->height;
+    int inW = inData->inWidth;
+    int inH = inData->inHeight;
+    ProjectFootprint *ret = ioFootprint;
+    ret->top = inH;
+    ret->bottom = 0;
+    bool distorted = has_distortion(inParams);
+    for (int y = 0; y != h; ++y) {
+        //  a scanline reaches halfway to its neighbors
+        float yc = inData->yPerScanline[y];
+        float prev = (y > 0) ? inData->yPerScanline[y-1] : 2.0f * yc - inData->yPerScanline[y+1];
+        float next = (y < h-1) ? inData->yPerScanline[y+1] : 2.0f * yc - inData->yPerScanline[y-1];
+        float rowTop = (std::min(prev, next) + yc) * 0.5f;
+        float rowBottom = (std::max(prev, next) + yc) * 0.5f;
+        float xx = inData->xPerScanline[y];
+        float xd = inData->incrementPerScanline[y];
+        for (int x = 0; x != w; ++x) {
+            float xa = xx - fabsf(xd) * 0.5f;
+            float xb = xx + fabsf(xd) * 0.5f;
+            float ya = rowTop;
+            float yb = rowBottom;
+            float cx = xx, cy = yc;
+            if (distorted) {
+                //  bounding box of the distorted corners
+                float px[4] = { xa, xb, xa, xb };
+                float py[4] = { ya, ya, yb, yb };
+                project_distort(inParams, xx, yc, &cx, &cy);
+                xa = xb = cx;
+                ya = yb = cy;
+                for (int k = 0; k != 4; ++k) {
+                    float dx, dy;
+                    project_distort(inParams, px[k], py[k], &dx, &dy);
+                    xa = std::min(xa, dx);
+                    xb = std::max(xb, dx);
+                    ya = std::min(ya, dy);
+                    yb = std::max(yb, dy);
+                }
+            }
+            int i = y * w + x;
+            short *box = ret->box + 4 * i;
+            int sx = (int)floorf(cx);
+            int sy = (int)floorf(cy);
+            if (sx < 0 || sx >= inW || sy < 0 || sy >= inH) {
+                box[0] = box[1] = box[2] = box[3] = 0;
+                ret->scale[i] = 0;
+            } else {
+                int x0, x1, y0, y1;
+                pixel_span(xa, xb, cx, inW, x0, x1);
+                pixel_span(ya, yb, cy, inH, y0, y1);
+                int area = (x1 - x0) * (y1 - y0);
+                //  the summed-area table is 16 bits, and wraps; box sums 
+                //  are still right as long as no box has 64k pixels
+                if (area > 0xffff) {
+                    return -2;
+                }
+                box[0] = x0;
+                box[1] = y0;
+                box[2] = x1;
+                box[3] = y1;
+                ret->top = std::min(ret->top, y0);
+                ret->bottom = std::max(ret->bottom, y1);
+                ret->scale[i] = ((255u << 16) + area / 2) / area;
+            }
+            xx += xd;
+        }
+    }
+    if (ret->top > ret->bottom) {
+        //  nothing in view
+        ret->top = ret->bottom = 0;
+    }
+    //  empty boxes must read the zero row
+    for (int i = 0; i != w * h; ++i) {
+        if (!ret->scale[i]) {
+            ret->box[4*i+1] = ret->box[4*i+3] = ret->top;
+        }
+    }
+    return 0;
+}
+
+int make_project_footprint(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        struct ProjectFootprint **outFootprint)
+{
+    *outFootprint = NULL;
+    int w = inData->width;
+    int h = inData->height;
+    int inW = inData->inWidth;
+    int inH = inData->inHeight;
+    if (h < 2) {
+        return -1;
+    }
+    ProjectFootprint *ret = (ProjectFootprint *)malloc(sizeof(ProjectFootprint)
+        + sizeof(unsigned int) * w * h
+        + sizeof(short) * 4 * w * h
+        + sizeof(unsigned short) * (inW + 1) * (inH + 1));
+    if (!ret) {
+        return -1;
+    }
+    ret->width = w;
+    ret->height = h;
+    ret->inWidth = inW;
+    ret->inHeight = inH;
+    ret->scale = (unsigned int *)&ret[1];
+    ret->box = (short *)(ret->scale + w * h);
+    ret->integral = (unsigned short *)(ret->box + 4 * w * h);
+    if (!bit_prefix[255][7]) {
+        init_bit_prefix();
+    }
+    int err = update_project_footprint(inParams, inData, ret);
+    if (err) {
+        free(ret);
+        return err;
+    }
+    *outFootprint = ret;
+    return 0;
+}
+
+void free_project_footprint(
+        struct ProjectFootprint *freeFootprint) {
+    free(freeFootprint);
+}
 
+void project_occupancy(
+        struct ProjectFootprint *inFootprint,
+        unsigned char const *srcMask,
+        unsigned char *dst)
+{
+    int inW = inFootprint->inWidth;
+    int iw = inW + 1;
+    int stride = MASK_STRIDE(inW);
+    unsigned short *ii = inFootprint->integral;
+    //  rows above the top box don't matter; the table starts at zero there
+    int top = inFootprint->top;
+    memset(ii + top * iw, 0, sizeof(unsigned short) * iw);
+    for (int y = top; y != inFootprint->bottom; ++y) {
+        unsigned char const *row = srcMask + y * stride;
+        unsigned short const *above = ii + y * iw + 1;
+        unsigned short *cur = ii + (y + 1) * iw;
+        unsigned short run = 0;
+        *cur++ = 0;
+        int x = 0;
+        for (; x + 8 <= inW; x += 8) {
+            unsigned char const *pre = bit_prefix[row[x >> 3]];
+            for (int k = 0; k != 8; ++k) {
+                cur[k] = above[k] + run + pre[k];
+            }
+            run += pre[7];
+            cur += 8;
+            above += 8;
+        }
+        for (int k = 0; x != inW; ++x, ++k) {
+            run += (row[x >> 3] >> k) & 1;
+            *cur++ = *above++ + run;
+        }
+    }
+    int n = inFootprint->width * inFootprint->height;
+    short const *box = inFootprint->box;
+    unsigned int const *scale = inFootprint->scale;
+    for (int i = 0; i != n; ++i) {
+        int top = box[1] * iw;
+        int bottom = box[3] * iw;
+        unsigned short sum = ii[bottom + box[2]] - ii[top + box[2]] - ii[bottom + box[0]] + ii[top + box[0]];
+        dst[i] = (unsigned char)((sum * scale[i]) >> 16);
+        box += 4;
+    }
+}
@@ -20,6 +20,23 @@ struct ProjectParameters {
     int inHeight;
     int outWidth;
     int outHeight;
+    int bakeGather;     /* also build ProjectData::gather */
+    /* 0 (or 1) for evenly spaced output rows. Otherwise each row is this 
+     * much deeper than the one nearer to it, so a map of the same size 
+     * reaches farther, at desiredOutResolution near the camera and 
+     * coarser with distance. Columns stay desiredOutResolution apart.
+     */
+    float rowGrowth;
+    /* Lens distortion (Brown-Conrady: radial k1-k3, tangential p1-p2,) 
+     * in units of the focal length around the image center. If any 
+     * are set, the plan always gets a gather map. mkcalib estimates 
+     * k1 and k2 from checkerboard frames.
+     */
+    float k1;
+    float k2;
+    float k3;
+    float p1;
+    float p2;
 };
 
 struct ProjectData {
@@ -32,10 +49,13 @@ struct ProjectData {
     float *yPerScanline;
     float *xPerScanline;
     float *incrementPerScanline;
-    //  TODO: derivatives to compensate for distortion
+    float *groundYPerScanline;  /* distance ahead of the camera of each row */
+    int *gather;        /* optional: width * height source offsets (y * inWidth + x) */
+    int *chromaGather;  /* with gather: (y/2) * (inWidth/2) + x/2, for I420 chroma */
 };
 
 #define MISSING_DATA 0x02
+#define GATHER_MISSING -1
 
 /* First, fill out your camera parameters, and bake some 
  * pre-calculated data for generating output images.
@@ -47,8 +67,78 @@ PROJECT_EXPORT int make_project_data(
 PROJECT_EXPORT void free_project_data(
         struct ProjectData *freeData);
 
+/* Re-aim an existing plan for a different camera pitch, re-baking its 
+ * scanline tables (and gather map, if it has one) in place. This takes 
+ * no allocation or matrix math, so it is cheap enough to do per frame. 
+ * inParams must be what the plan was made from; its angledDownRadians 
+ * is ignored.
+ */
+PROJECT_EXPORT int project_set_pitch(
+        struct ProjectParameters const *inParams,
+        struct ProjectData *ioData,
+        float angledDownRadians);
+
+/* Where the ray through a pixel of the ideal image meets the ground, for 
+ * the given pitch; non-zero if it doesn't.
+ */
+PROJECT_EXPORT int project_image_to_ground(
+        struct ProjectParameters const *inParams,
+        float angledDownRadians,
+        float x,
+        float y,
+        float *outX,
+        float *outY);
+
+/* Where the center of an output cell is on the ground: x to the right of 
+ * the camera, y ahead of it, in the units of heightOfCamera.
+ */
+PROJECT_EXPORT void project_cell_ground(
+        struct ProjectData const *inData,
+        float x,
+        float y,
+        float *outX,
+        float *outY);
+
+/* Map a pixel of the ideal (pinhole) image to where the lens actually 
+ * puts it, and back.
+ */
+PROJECT_EXPORT void project_distort(
+        struct ProjectParameters const *inParams,
+        float x,
+        float y,
+        float *outX,
+        float *outY);
+
+PROJECT_EXPORT void project_undistort(
+        struct ProjectParameters const *inParams,
+        float x,
+        float y,
+        float *outX,
+        float *outY);
+
+/* Baking a plan needs a bunch of matrix math, so plans can be saved to 
+ * disk. make_project_data_cached() looks for a plan made from the same 
+ * parameters in the given directory, and makes and saves one if there 
+ * is none.
+ */
+PROJECT_EXPORT int save_project_data(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        char const *path);
+
+PROJECT_EXPORT int load_project_data(
+        struct ProjectParameters const *inParams,
+        char const *path,
+        struct ProjectData **outData);
+
+PROJECT_EXPORT int make_project_data_cached(
+        struct ProjectParameters const *inParams,
+        char const *dir,
+        struct ProjectData **outData);
+
 /* Then pass in an input image, and generate the corresponding
- * flat-projected output image.
+ * flat-projected output image. With a baked gather map, this is a 
+ * branch-free table lookup per output pixel.
  */
 PROJECT_EXPORT void project_bitmap(
         struct ProjectData const *inData,
@@ -56,4 +146,89 @@ PROJECT_EXPORT void project_bitmap(
         unsigned char *dst,
         int bpp);
 
+/* The same, when src is a 1bpp mask (see mask.h.) With outMask set, dst 
+ * is a mask too, and cells outside the camera view are 0; otherwise dst 
+ * gets one byte per cell of 0, 255, or MISSING_DATA.
+ */
+PROJECT_EXPORT void project_mask(
+        struct ProjectData const *inData,
+        unsigned char const *src,
+        unsigned char *dst,
+        int outMask);
+
+/* Colour ground view from a planar I420 frame of inWidth x inHeight,
+ * written as 3 bytes per cell. Each cell takes the chroma sample that
+ * covers its luma pixel. Cells outside the camera view are luma
+ * MISSING_DATA with neutral chroma.
+ */
+#define PROJECT_PACKED_RGB 0
+#define PROJECT_PACKED_YUV 1
+
+PROJECT_EXPORT void project_i420(
+        struct ProjectData const *inData,
+        unsigned char const *src,
+        unsigned char *dst,
+        int outFormat);
+
+/* Where one output cell covers several source pixels, the single sample 
+ * project_bitmap() takes makes thin lines flicker in and out. A 
+ * footprint plan stores the block of source pixels each cell covers 
+ * (baked from the scanline plan, and through the lens model if there is 
+ * one) and a 16.16 fixed-point scale for its area. project_occupancy() 
+ * then writes the fraction of each block that is set in a 1bpp mask, 
+ * 0 to 255, using a summed-area table of the mask; cells outside the 
+ * camera view are 0.
+ */
+struct ProjectFootprint {
+    int width;
+    int height;
+    int inWidth;
+    int inHeight;
+    int top;                    /* source rows any box covers: [top, bottom) */
+    int bottom;
+    short *box;                 /* 4 per cell: x0, y0, x1, y1 (exclusive) */
+    unsigned int *scale;        /* per cell: (255 << 16) / area, or 0 */
+    unsigned short *integral;   /* (inWidth + 1) * (inHeight + 1) scratch */
+};
+
+PROJECT_EXPORT int make_project_footprint(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        struct ProjectFootprint **outFootprint);
+
+/* re-bake a footprint plan in place, after project_set_pitch() */
+PROJECT_EXPORT int update_project_footprint(
+        struct ProjectParameters const *inParams,
+        struct ProjectData const *inData,
+        struct ProjectFootprint *ioFootprint);
+
+PROJECT_EXPORT void free_project_footprint(
+        struct ProjectFootprint *freeFootprint);
+
+PROJECT_EXPORT void project_occupancy(
+        struct ProjectFootprint *inFootprint,
+        unsigned char const *srcMask,
+        unsigned char *dst);
+
+/* The distinct source pixels that project_bitmap() samples, in raster 
+ * order, and which one each output cell uses. This lets per-pixel work 
+ * (like color classification) run only on pixels that end up in the 
+ * output, each of them once.
+ */
+struct ProjectSamples {
+    int count;
+    int width;
+    int height;
+    int *srcOffset;         /* count entries: y * inWidth + x */
+    int *chromaOffset;      /* count entries: (y/2) * (inWidth/2) + x/2 */
+    int *cellSample;        /* width * height entries; -1 for MISSING_DATA */
+};
+
+PROJECT_EXPORT int make_project_samples(
+        struct ProjectData const *inData,
+        struct ProjectSamples **outSamples);
+
+PROJECT_EXPORT void free_project_samples(
+        struct ProjectSamples *freeSamples);
+
 #endif  //  project_h
@@ -1,6 +1,5 @@
 #include "queue.h"
 #include "reactive.h"
-#include "plock.h"
 #include <assert.h>
 
 
@@ -39,16 +38,10 @@ void Frame::endRead() {
 
 void Frame::recycle() {
     assert(state_ != TO_WRITE);
-    Frame *link = NULL;
-    {
-        PLock lock(queue_->mutex_);
-        link = link_;
-        if (link) {
-            link_ = NULL;
-        }
-        state_ = TO_WRITE;
-        queue_->toWrite_.push_back(this);
-    }
+    //  once it's free, the writer may re-link it
+    Frame *link = link_;
+    link_ = NULL;
+    queue_->putFree(this);
     if (link) {
         link->recycle();
     }
@@ -65,10 +58,14 @@ void Frame::link(Frame *other) {
 
 FrameQueue::FrameQueue(size_t n, size_t size, int width, int height, int format)
     : target_(NULL)
-    , mutex_(PTHREAD_MUTEX_INITIALIZER)
+    , readHead_(0)
+    , readTail_(0)
+    , toWrite_(0)
+    , overwritten_(0)
     , count_(n)
-    , readEmpty_(true)
+    , policy_(FRAME_POLICY_DROP_NEW)
 {
+    assert(n > 0 && n <= FRAME_QUEUE_MAX);
     for (size_t i = 0; i != n; ++i) {
         Frame *f = new Frame(size);
         f->queue_ = this;
@@ -78,63 +75,97 @@ FrameQueue::FrameQueue(size_t n, size_t size, int width, int height, int format)
         f->format_ = format;
         f->index_ = (int)i;
         f->state_ = TO_WRITE;
-        toWrite_.push_back(f);
+        frames_[i] = f;
+        toRead_[i].store(NULL, std::memory_order_relaxed);
     }
+    toWrite_ = (uint32_t)((2ull << (n - 1)) - 1);
 }
 
 FrameQueue::~FrameQueue() {
-    for (auto & ptr : toRead_) {
-        delete ptr;
-    }
-    for (auto &ptr : toWrite_) {
-        delete ptr;
+    //  frames still out with some thread are left to it
+    for (size_t i = 0; i != count_; ++i) {
+        if (frames_[i]->state_ == TO_WRITE || frames_[i]->state_ == TO_READ) {
+            delete frames_[i];
+        }
     }
 }
 
 void FrameQueue::setTarget(Reactive *target) {
-    target_ = target;
+    target_.store(target, std::memory_order_release);
+}
+
+void FrameQueue::setPolicy(int policy) {
+    policy_ = policy;
 }
 
+//  Only beginWrite() takes bits out of toWrite_, and its callers don't 
+//  overlap (see queue.h,) so the bit it picks stays its own between the 
+//  load and the clear; recycling may set others meanwhile.
 Frame *FrameQueue::beginWrite() {
-    PLock lock(mutex_);
-    if (toWrite_.empty()) {
-        return NULL;
+    uint32_t free = toWrite_.load(std::memory_order_acquire);
+    if (!free) {
+        return policy_ == FRAME_POLICY_LATEST ? takeOldest() : NULL;
     }
-    Frame *ret = toWrite_.front();
-    toWrite_.pop_front();
+    uint32_t bit = free & (0u - free);
+    toWrite_.fetch_and(~bit, std::memory_order_relaxed);
+    Frame *ret = frames_[__builtin_ctz(bit)];
     assert(ret->state_ == TO_WRITE);
     ret->state_ = IN_WRITE;
     return ret;
 }
 
+//  There are only count_ frames, and the ones being read aren't free 
+//  until they are done, so the ring can't overrun. endWrite() calls don't 
+//  overlap, so the tail has one owner at a time.
 void FrameQueue::endWrite(Frame *f) {
     if (f) {
         assert(f->state_ == IN_WRITE);
-        Reactive *target = NULL;
-        {
-            PLock lock(mutex_);
-            f->state_ = TO_READ;
-            toRead_.push_back(f);
-            readEmpty_ = false;
-            target = target_;
-        }
+        f->state_ = TO_READ;
+        size_t tail = readTail_.load(std::memory_order_relaxed);
+        assert(tail - readHead_.load(std::memory_order_acquire) < count_);
+        toRead_[tail % count_].store(f, std::memory_order_relaxed);
+        readTail_.store(tail + 1, std::memory_order_release);
+        Reactive *target = target_.load(std::memory_order_acquire);
         if (target) {
             target->react();
         }
     }
 }
 
+//  With FRAME_POLICY_LATEST the writer may take the frame at the head 
+//  too, so the head only moves by compare-exchange; whoever moves it owns 
+//  the frame. The head only grows, so a stale one can't compare equal.
 Frame *FrameQueue::beginRead() {
-    PLock lock(mutex_);
-    if (toRead_.empty()) {
-        return NULL;
+    size_t head = readHead_.load(std::memory_order_acquire);
+    while (head != readTail_.load(std::memory_order_acquire)) {
+        Frame *ret = toRead_[head % count_].load(std::memory_order_relaxed);
+        if (readHead_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            assert(ret->state_ == TO_READ);
+            ret->state_ = IN_READ;
+            return ret;
+        }
     }
-    Frame *ret = toRead_.front();
-    assert(ret->state_ == TO_READ);
-    ret->state_ = IN_READ;
-    toRead_.pop_front();
-    readEmpty_ = toRead_.empty();
-    return ret;
+    return NULL;
+}
+
+//  take back the oldest unread frame, dropping whatever is linked to it
+Frame *FrameQueue::takeOldest() {
+    size_t head = readHead_.load(std::memory_order_acquire);
+    while (head != readTail_.load(std::memory_order_acquire)) {
+        Frame *ret = toRead_[head % count_].load(std::memory_order_relaxed);
+        if (readHead_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            assert(ret->state_ == TO_READ);
+            ret->state_ = IN_WRITE;
+            Frame *link = ret->link_;
+            ret->link_ = NULL;
+            if (link) {
+                link->recycle();
+            }
+            overwritten_.fetch_add(1, std::memory_order_relaxed);
+            return ret;
+        }
+    }
+    return NULL;
 }
 
 void FrameQueue::endRead(Frame *f) {
@@ -145,15 +176,27 @@ void FrameQueue::endRead(Frame *f) {
 }
 
 bool FrameQueue::readEmpty() {
-    return readEmpty_;
+    return readHead_.load(std::memory_order_acquire) == readTail_.load(std::memory_order_acquire);
 }
 
-void FrameQueue::getStats(int &oInSize, int &oOutSize, int &oInFlight) {
-    PLock lock(mutex_);
-    oInSize = (int)toWrite_.size();
-    oOutSize = (int)toRead_.size();
-    oInFlight = (int)count_ - oInSize - oOutSize;
+void FrameQueue::putFree(Frame *f) {
+    f->state_ = TO_WRITE;
+    uint32_t bit = 1u << f->index_;
+    uint32_t was = toWrite_.fetch_or(bit, std::memory_order_release);
+    (void)was;
+    assert(!(was & bit));
 }
 
+//  without a lock, the three numbers can be from slightly different moments
+void FrameQueue::getStats(int &oInSize, int &oOutSize, int &oInFlight) {
+    int overwritten;
+    getStats(oInSize, oOutSize, oInFlight, overwritten);
+}
 
-
+void FrameQueue::getStats(int &oInSize, int &oOutSize, int &oInFlight, int &oOverwritten) {
+    size_t head = readHead_.load(std::memory_order_acquire);
+    oInSize = __builtin_popcount(toWrite_.load(std::memory_order_acquire));
+    oOutSize = (int)(readTail_.load(std::memory_order_acquire) - head);
+    oInFlight = (int)count_ - oInSize - oOutSize;
+    oOverwritten = overwritten_.load(std::memory_order_relaxed);
+}
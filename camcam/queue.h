@@ -3,20 +3,44 @@
 
 #include <atomic>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
-#include <list>
 
 class Reactive;
 class FrameQueue;
 
 struct Frame;
 
+/* A queue never takes a lock, so the camera callback and the analyzer 
+ * never wait on each other. Written frames go through a fixed ring of 
+ * Frame pointers:
+ *  - Any number of threads may read (a Pipeline's workers all do,) since 
+ *    beginRead() moves the ring's head by compare-exchange.
+ *  - Writing is up to the caller to serialize: no two beginWrite() calls 
+ *    may overlap, and no two endWrite() calls. One beginWrite() may overlap 
+ *    one endWrite(); a Pipeline's workers call beginWrite() under their 
+ *    mutex, and endWrite() in their in-order turn.
+ * Free frames are a bit per frame (so at most FRAME_QUEUE_MAX of them,) 
+ * because a frame can be recycled from any thread that ends up holding it 
+ * through Frame::link(); only beginWrite() takes bits out.
+ */
+#define FRAME_QUEUE_MAX 32
+
+/* What beginWrite() does when no frame is free: return NULL, so the new 
+ * frame is dropped (the default,) or take back the oldest frame not yet 
+ * read, so the reader always gets the latest ones. getStats() counts how 
+ * many frames were taken back.
+ */
+#define FRAME_POLICY_DROP_NEW 0
+#define FRAME_POLICY_LATEST 1
+
 class FrameQueue {
     public:
         FrameQueue(size_t n, size_t size, int width, int height, int format);
         ~FrameQueue();
 
         void setTarget(Reactive *target);
+        void setPolicy(int policy);
 
         Frame *beginWrite();
         void endWrite(Frame *);
@@ -26,15 +50,21 @@ class FrameQueue {
         bool readEmpty();
     
         void getStats(int &oInSize, int &oOutSize, int &oInFlight);
+        void getStats(int &oInSize, int &oOutSize, int &oInFlight, int &oOverwritten);
 
     private:
         friend class Frame;
-        Reactive *target_;
-        std::list<Frame *> toRead_;
-        std::list<Frame *> toWrite_;
-        pthread_mutex_t mutex_;
+        void putFree(Frame *f);
+        Frame *takeOldest();
+        std::atomic<Reactive *> target_;
+        Frame *frames_[FRAME_QUEUE_MAX];
+        std::atomic<Frame *> toRead_[FRAME_QUEUE_MAX];  //  ring, slot = position % count_
+        std::atomic<size_t> readHead_;      //  advanced by the reader (or a reclaiming writer)
+        std::atomic<size_t> readTail_;      //  advanced by the writer
+        std::atomic<uint32_t> toWrite_;     //  bit index_ set when free
+        std::atomic<int> overwritten_;
         size_t count_;
-        bool readEmpty_;
+        int policy_;
 };
 
 //  format:
@@ -42,6 +72,12 @@ class FrameQueue {
 //  2 == YUV420
 //  3 == RGB
 //  4 == RGBA
+//  5 == 1bpp mask (see mask.h)
+#define FRAME_FORMAT_GRAY 1
+#define FRAME_FORMAT_YUV420 2
+#define FRAME_FORMAT_RGB 3
+#define FRAME_FORMAT_RGBA 4
+#define FRAME_FORMAT_MASK 5
 struct Frame {
     public:
         Frame(size_t size);